@@ -15,12 +15,21 @@
  */
 
 reg r[NUM_REGS];
+arm_flags_t arm_flags;
+
+reg arm_flags_pack(void)
+{
+    return arm_flag_z() << Z_SHIFT | arm_flag_v() << V_SHIFT |
+           arm_flag_n() << N_SHIFT | arm_flag_c() << C_SHIFT;
+}
 
 reg arm_get_reg(int reg_num)
 {
     ASSERT(reg_num < NUM_REGS);
     ASSERT(reg_num >= 0);
 
+    if (reg_num == FLAGS) arm_flags_sync();
+
     return r[reg_num];
 }
 
@@ -40,6 +49,8 @@ void arm_set_reg(int reg_num, reg val)
     ASSERT(reg_num < NUM_REGS);
     ASSERT(reg_num >= 0);
 
+    if (reg_num == FLAGS) arm_flags.kind = FLAGS_PACKED;
+
     r[reg_num] = val;
 }
 
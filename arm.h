@@ -45,10 +45,97 @@
 #define IBITS(bit, nbits)       BITS(instr, bit, nbits)
 #define IBIT(bit)               BIT(instr, bit)
 
+extern reg r[NUM_REGS];
+
 reg arm_get_reg(int reg_num);
 void arm_set_reg(int reg_num, reg val);
 void arm_dump_registers(void);
 
+/*
+ * Lazy condition flags
+ *
+ * A flag setting data-processing instruction doesn't pack NZCV into
+ * r[FLAGS].  It leaves its result in arm_flags (and, for arithmetic, the
+ * two addends), and each flag is worked out only when something reads
+ * it.  r[FLAGS] is only current while arm_flags.kind is FLAGS_PACKED;
+ * arm_get_reg(FLAGS) packs the flags first, and arm_set_reg(FLAGS, ...)
+ * makes the packed value current again.
+ */
+
+enum {
+    FLAGS_PACKED,       // r[FLAGS] holds the flags
+    FLAGS_LOGIC,        // N and Z from d; C and V as saved
+    FLAGS_ARITH,        // All four from d = n + m (+ carry in)
+};
+
+typedef struct arm_flags_s {
+    reg kind;
+    reg n, m, d;
+    reg c, v;
+} arm_flags_t;
+
+extern arm_flags_t arm_flags;
+
+reg arm_flags_pack(void);
+
+static inline void arm_flags_logic(reg d, reg c, reg v)
+{
+    arm_flags.kind = FLAGS_LOGIC;
+    arm_flags.d = d;
+    arm_flags.c = c;
+    arm_flags.v = v;
+}
+
+static inline void arm_flags_arith(reg n, reg m, reg d)
+{
+    arm_flags.kind = FLAGS_ARITH;
+    arm_flags.n = n;
+    arm_flags.m = m;
+    arm_flags.d = d;
+}
+
+static inline reg arm_flag_z(void)
+{
+    if (arm_flags.kind == FLAGS_PACKED) return (r[FLAGS] & Z) >> Z_SHIFT;
+    return arm_flags.d == 0;
+}
+
+static inline reg arm_flag_n(void)
+{
+    if (arm_flags.kind == FLAGS_PACKED) return (r[FLAGS] & N) >> N_SHIFT;
+    return arm_flags.d >> 31;
+}
+
+static inline reg arm_flag_c(void)
+{
+    reg n = arm_flags.n, m = arm_flags.m, d = arm_flags.d;
+
+    switch (arm_flags.kind) {
+    case FLAGS_PACKED: return (r[FLAGS] & C) >> C_SHIFT;
+    case FLAGS_LOGIC:  return arm_flags.c;
+    default:           return ((n & m) | ((n | m) & ~d)) >> 31;
+    }
+}
+
+static inline reg arm_flag_v(void)
+{
+    reg n = arm_flags.n, m = arm_flags.m, d = arm_flags.d;
+
+    switch (arm_flags.kind) {
+    case FLAGS_PACKED: return (r[FLAGS] & V) >> V_SHIFT;
+    case FLAGS_LOGIC:  return arm_flags.v;
+    default:           return (~(n ^ m) & (d ^ m)) >> 31;
+    }
+}
+
+static inline void arm_flags_sync(void)
+{
+    if (arm_flags.kind != FLAGS_PACKED) {
+        r[FLAGS] = arm_flags_pack();
+        arm_flags.kind = FLAGS_PACKED;
+    }
+}
+
 extern char *regs[];
 
 typedef reg arm_cond_t;
@@ -90,6 +177,122 @@ typedef enum {
     ARM_INSTR_LDM,
 } arm_instr_t;
 
+/*
+ * Predecoded instruction cache
+ *
+ * Each guest word that has been executed is decoded once into an
+ * icache_entry_t.  The entry carries the operand fields execute_one()
+ * would otherwise pull out of the instruction on every pass, along with
+ * the handler that executes it.  Entries are grouped into pages of
+ * ICACHE_PAGE_SIZE bytes of guest address space.
+ */
+
+#define ICACHE_PAGE_SHIFT	12
+#define ICACHE_PAGE_SIZE	(1 << ICACHE_PAGE_SHIFT)
+#define ICACHE_PAGE_MASK	(ICACHE_PAGE_SIZE - 1)
+
+typedef struct icache_entry_s icache_entry_t;
+typedef int (*arm_handler_t)(icache_entry_t *e);
+
+struct icache_entry_s {
+    arm_handler_t handler;  // NULL when the entry must be (re)decoded
+    reg instr;
+    arm_instr_t op;
+    reg imm;                // Rotated immediate, signed offset or branch dest
+    byte imm_carry;         // Carry out of the rotated immediate
+    byte cond;
+    byte rd, rn, rm, rs;
+    byte shift_type;
+    byte shift;             // Immediate shift amount
+    byte imm_form;          // Operand 2 (or the offset) is an immediate
+    byte reg_shift;         // Shift amount comes from rs
+    byte setconds;
+    byte pre_post, up_down, write_back;
+    byte byte_xfer;         // LDRB/STRB
+    byte link;              // BL
+    byte span;              // Words run by the handler, if more than one
+    byte covered;           // Inside a fused sequence or a translated block
+    uint16_t heat;          // Executions seen by the JIT before translation
+    void *block;            // Translated block starting here
+    struct super_group_s *group;    // Superinstruction starting here
+};
+
+extern int icache_disable;
+
+void icache_predecode(icache_entry_t *e, reg pc, reg instr);
+icache_entry_t *icache_lookup(reg pc);
+void icache_invalidate(reg addr);
+void icache_invalidate_range(reg addr, reg size);
+void icache_drop_all_blocks(void);
+int icache_ends_block(icache_entry_t *e);
+
+/*
+ * Fused muForth machinery (see dtc.c)
+ */
+
+#define NEXT		0xe494f004	/* ldr     pc, [ip], 4 */
+#define ENTER		0xe1a0400e	/* mov     ip, lr: docolon and dodoes */
+
+extern int forth_fuse;
+
+int forth_fuse_machinery(icache_entry_t *e, reg pc);
+
+/*
+ * Execution engines
+ *
+ * The interpreter runs every instruction class through one generic
+ * handler.  The threaded engine picks a handler specialized for the
+ * opcode, operand form and S bit when the instruction is predecoded.
+ * The JIT translates hot basic blocks to host code and uses the threaded
+ * handlers for everything it leaves to the interpreter.
+ */
+
+enum {
+    EXECUTE_ENGINE_INTERP,
+    EXECUTE_ENGINE_THREADED,
+    EXECUTE_ENGINE_JIT,
+};
+
+extern int execute_engine;
+
 reg decode_dest_addr(reg addr, reg offset, int offset_sz, int half_flag);
 arm_instr_t arm_decode_instr(reg instr);
+reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift, reg *carry_out);
+int execute_check_conds(reg conds);
+int execute_callbacks(reg pc);
+int execute_ldr(icache_entry_t *e);
+int execute_str(icache_entry_t *e);
+int execute_ldm(icache_entry_t *e);
+int execute_stm(icache_entry_t *e);
+int execute_mul(icache_entry_t *e);
+int execute_mull(icache_entry_t *e);
+arm_handler_t execute_handler(icache_entry_t *e);
 int execute_one(void);
+
+arm_handler_t threaded_handler(icache_entry_t *e);
+int threaded_run(void);
+
+/*
+ * Superinstructions (see super.c)
+ */
+
+#define SUPER_THRESHOLD		32
+
+extern int super_enable;
+
+void super_form(icache_entry_t *e, reg pc);
+void super_report(void);
+
+extern int jit_flushed;
+int jit_run(void);
+
+/*
+ * Profiler (see profile.c)
+ */
+
+extern int profile_enable;
+extern int profile_top;
+extern int profile_words;
+
+int profile_run(void);
+void profile_report(void);
@@ -0,0 +1,110 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * baseline.c
+ *
+ * Resetting the machine to a baseline in place.
+ *
+ * baseline_take() remembers the registers and starts tracking writes (see
+ * mem_track_writes in memory.c).  The first time a page is written after
+ * the baseline, a copy of the page as it was is kept, and the page goes
+ * on the dirty list.  baseline_reset() copies back just the dirty pages
+ * and the registers, so it costs as much as the pages written since the
+ * last reset, not as much as all of memory.
+ *
+ * The copies never change once made: a page holds the same thing at
+ * every reset.  So a page written again after a reset is only put back
+ * on the dirty list; it isn't copied again.
+ *
+ * Checkpoints use the same write tracking, so there can't be a baseline
+ * with -checkpoint.
+ */
+
+#include "sim.h"
+#include "arm.h"
+
+int baseline_active;
+
+static reg baseline_regs[NUM_REGS];
+static reg baseline_getfiles;
+
+static byte **baseline_pages;		// The copies, by page
+static reg *baseline_dirty;		// Pages written since the last reset
+static int num_baseline_dirty, max_baseline_dirty;
+
+void baseline_take(void)
+{
+    if (checkpoint_interval) {
+        error("There can't be a baseline with -checkpoint");
+    }
+
+    if (!baseline_pages) {
+        baseline_pages = calloc(MEM_NUM_PAGES, sizeof(byte *));
+        ASSERT(baseline_pages);
+    }
+
+    /*
+     * Copies kept for an earlier baseline are out of date.
+     */
+    for (reg page = 0; page < MEM_NUM_PAGES; page++) {
+        free(baseline_pages[page]);
+        baseline_pages[page] = NULL;
+    }
+    num_baseline_dirty = 0;
+
+    for (int i = 0; i < NUM_REGS; i++) {
+        baseline_regs[i] = arm_get_reg(i);
+    }
+    baseline_getfiles = io_getfiles();
+
+    baseline_active = 1;
+    mem_track_writes = 1;
+    mem_clear_written();
+}
+
+void baseline_page_written(reg page)
+{
+    byte **copy = &baseline_pages[MEM_PAGE(page)];
+
+    if (!*copy) {
+        *copy = malloc(MEM_PAGE_SIZE);
+        ASSERT(*copy);
+        mem_copy_page(page, *copy, 0);
+    }
+
+    if (num_baseline_dirty == max_baseline_dirty) {
+        max_baseline_dirty = max_baseline_dirty ? max_baseline_dirty * 2 : 256;
+        baseline_dirty = realloc(baseline_dirty, max_baseline_dirty * sizeof(reg));
+        ASSERT(baseline_dirty);
+    }
+    baseline_dirty[num_baseline_dirty++] = page;
+}
+
+void baseline_reset(void)
+{
+    if (!baseline_active) {
+        return;
+    }
+
+    for (int i = 0; i < num_baseline_dirty; i++) {
+        reg page = baseline_dirty[i];
+
+        mem_copy_page(page, baseline_pages[MEM_PAGE(page)], 1);
+        icache_invalidate_range(page, MEM_PAGE_SIZE);
+    }
+    num_baseline_dirty = 0;
+    mem_clear_written();
+    forth_index_reset();
+
+    for (int i = 0; i < NUM_REGS; i++) {
+        arm_set_reg(i, baseline_regs[i]);
+    }
+    io_set_getfiles(baseline_getfiles);
+    undo_forget();
+    sim_done = 0;
+}
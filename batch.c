@@ -0,0 +1,289 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * batch.c
+ *
+ * Batch mode (-batch listfile).
+ *
+ * The list file names one job per line: a file of input for the Forth.
+ * The simulator boots as usual (or starts from -restore or -boot-cache)
+ * and runs until the Forth first asks for a line.  There, batch_start()
+ * starts the jobs.  Each job reads its file as its input, writes its
+ * output to the job's file with ".out" added, and runs to the end as a
+ * normal run would.  One line per job is printed as it finishes:
+ *
+ *	<job>: exit <status>	<job>: signal <n>	<job>: fault at <pc>
+ *
+ * and the simulator exits 0 if every job succeeded.
+ *
+ * By default, a child is forked for each job.  It inherits the booted
+ * machine copy-on-write.  The parent keeps up to -jobs children running,
+ * the number of processors by default.  A child whose job faults leaves
+ * the pc in a shared table for the parent to report.
+ *
+ * With -batch-reset, the jobs run one after another in this process
+ * instead.  Between jobs the machine is reset to a baseline (see
+ * baseline.c) taken at the first readline, which costs only the pages
+ * the last job wrote.  A job that faults doesn't end the batch.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+char *batch_list;
+int batch_jobs;
+int batch_reset;
+
+static char **batch_job_list;
+static int num_batch_jobs;
+
+static int batch_next_job;		// With -batch-reset
+static int batch_stdout = -1, batch_stderr;
+int batch_failed;
+
+typedef struct {
+    int faulted;
+    reg pc;
+} batch_fault_t;
+
+static batch_fault_t *batch_faults;	// Shared with the forked jobs
+static int batch_child = -1;		// The job this child runs
+
+static void batch_read_list(void)
+{
+    FILE *fp = fopen(batch_list, "r");
+    int max_jobs = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (!fp) {
+        error("Couldn't open batch list %s", batch_list);
+    }
+
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (!len) continue;
+
+        if (num_batch_jobs == max_jobs) {
+            max_jobs = max_jobs ? max_jobs * 2 : 64;
+            batch_job_list = realloc(batch_job_list, max_jobs * sizeof(char *));
+            ASSERT(batch_job_list);
+        }
+        batch_job_list[num_batch_jobs] = strdup(line);
+        ASSERT(batch_job_list[num_batch_jobs]);
+        num_batch_jobs++;
+    }
+    free(line);
+    fclose(fp);
+}
+
+/*
+ * batch_open()
+ *
+ * Queue the job's file as its input (see input.c), and make its output
+ * file stdout and stderr.
+ * Returns 0, with an explanation on stderr, if either can't be opened.
+ */
+
+static int batch_open(char *job)
+{
+    char *out;
+    int fd = -1;
+
+    if (asprintf(&out, "%s.out", job) < 0) {
+        error("Out of memory");
+    }
+
+    input_discard();
+    if (!input_queue_file(job) || (fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        fprintf(stderr, "%s: couldn't open the job's input or output\n", job);
+        free(out);
+        return 0;
+    }
+    free(out);
+    input_end();
+
+    io_set_output(stdout);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    return 1;
+}
+
+static void batch_report(char *job, int status)
+{
+    if (WIFEXITED(status)) {
+        printf("%s: exit %d\n", job, WEXITSTATUS(status));
+    } else {
+        printf("%s: signal %d\n", job, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+    fflush(stdout);
+
+    batch_failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void batch_report_fault(char *job, reg pc)
+{
+    printf("%s: fault at %8.8x\n", job, pc);
+    fflush(stdout);
+
+    batch_failed = 1;
+}
+
+static void batch_fork(void)
+{
+    pid_t *pids = calloc(num_batch_jobs + 1, sizeof(pid_t));
+    ASSERT(pids);
+
+    batch_faults = mmap(NULL, (num_batch_jobs + 1) * sizeof(batch_fault_t),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (batch_faults == MAP_FAILED) {
+        error("Couldn't map the batch fault table");
+    }
+
+    int limit = batch_jobs > 0 ? batch_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit < 1) limit = 1;
+
+    int next = 0, running = 0;
+    while (next < num_batch_jobs || running) {
+        if (next < num_batch_jobs && running < limit) {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                if (!batch_open(batch_job_list[next])) _exit(127);
+                batch_child = next;
+                sample_fork();
+                return;
+            }
+            if (pid < 0) {
+                error("Couldn't fork a batch job");
+            }
+            pids[next++] = pid;
+            running++;
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            break;
+        }
+        for (int i = 0; i < next; i++) {
+            if (pids[i] == pid) {
+                if (batch_faults[i].faulted) {
+                    batch_report_fault(batch_job_list[i], batch_faults[i].pc);
+                } else {
+                    batch_report(batch_job_list[i], status);
+                }
+                break;
+            }
+        }
+        running--;
+    }
+
+    exit(batch_failed);
+}
+
+/*
+ * With -batch-reset, start the next job that can be opened.  Returns 0
+ * when there are none left.
+ */
+
+static int batch_open_next(void)
+{
+    while (batch_next_job < num_batch_jobs) {
+        if (batch_open(batch_job_list[batch_next_job])) {
+            return 1;
+        }
+        batch_report(batch_job_list[batch_next_job++], 127 << 8);
+    }
+
+    return 0;
+}
+
+/*
+ * batch_start()
+ *
+ * Called at the first readline callback.  Returns with the first job's
+ * input and output in place.  When forking, it returns in each child and
+ * the parent exits once every job is done.
+ */
+
+void batch_start(void)
+{
+    batch_read_list();
+    batch_list = NULL;      // Later readlines are the jobs'
+
+    /*
+     * Whatever the boot printed isn't any job's output.
+     */
+    io_flush();
+    fflush(stdout);
+    fflush(stderr);
+
+    if (!batch_reset) {
+        batch_fork();
+        return;
+    }
+
+    baseline_take();
+    batch_stdout = dup(STDOUT_FILENO);
+    batch_stderr = dup(STDERR_FILENO);
+    if (!batch_open_next()) {
+        exit(batch_failed);
+    }
+}
+
+/*
+ * batch_next()
+ *
+ * Called when a run ends, ok if it didn't fault.  With -batch-reset,
+ * reports the job, resets the machine and returns 1 if there is another
+ * job to run.  After the last one, main() finishes the run and exits with
+ * batch_failed.  A forked job only records a fault for the parent.
+ */
+
+int batch_next(int ok)
+{
+    if (batch_child >= 0) {
+        if (!ok) {
+            batch_faults[batch_child].pc = arm_get_reg(PC);
+            batch_faults[batch_child].faulted = 1;
+            batch_failed = 1;
+        }
+        return 0;
+    }
+
+    if (batch_stdout < 0) {
+        return 0;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(batch_stdout, STDOUT_FILENO);
+    dup2(batch_stderr, STDERR_FILENO);
+
+    char *job = batch_job_list[batch_next_job++];
+    if (ok) {
+        batch_report(job, 0);
+    } else {
+        batch_report_fault(job, arm_get_reg(PC));
+    }
+
+    baseline_reset();
+
+    return batch_open_next();
+}
@@ -0,0 +1,258 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * checkpoint.c
+ *
+ * Checkpoints and replay (-checkpoint n).
+ *
+ * The undo log grows with every instruction run.  With -checkpoint n, the
+ * simulator instead takes a checkpoint of the machine every n
+ * instructions and goes back by restoring the checkpoint at or before the
+ * instruction wanted and running forward from there.  Going to any
+ * instruction costs one restore and at most n instructions, however long
+ * the run has been.
+ *
+ * A checkpoint holds the registers.  Memory is kept by page: the first
+ * time a page is written after checkpoint c, a copy of the page as it was
+ * at checkpoint c is saved (see mem_track_writes in memory.c).  The page
+ * as it was at checkpoint k is then the copy saved for the first
+ * checkpoint at or after k that has one; pages without such a copy
+ * haven't changed since k.
+ *
+ * Running forward again has to do what the instructions did the first
+ * time.  Instructions are deterministic, but the callbacks are not, so
+ * what readline and getfile put in memory is logged and played back
+ * instead of being read again, and output that was already written isn't
+ * written again.
+ */
+
+#include "sim.h"
+#include "arm.h"
+
+typedef struct checkpoint_s {
+    uint64_t count;
+    reg regs[NUM_REGS];
+} checkpoint_t;
+
+typedef struct checkpoint_page_s {
+    struct checkpoint_page_s *next;	// Copy for an earlier checkpoint
+    int checkpoint;
+    byte data[MEM_PAGE_SIZE];
+} checkpoint_page_t;
+
+typedef struct checkpoint_input_s {
+    uint64_t count;	// The callback instruction
+    reg result;		// What it left in R0
+    reg addr, len;	// What it wrote to memory
+    byte *data;
+} checkpoint_input_t;
+
+uint64_t checkpoint_interval;
+uint64_t checkpoint_count;	// Instructions run so far
+int checkpoint_replaying;	// The current instruction has run before
+
+static uint64_t checkpoint_high;	// The most instructions ever run
+static uint64_t checkpoint_next;	// When the next checkpoint is due
+static int checkpoint_current;
+
+static checkpoint_t *checkpoints;
+static int num_checkpoints, max_checkpoints;
+
+static checkpoint_page_t **checkpoint_pages;	// Newest copy first, by page
+static reg *checkpoint_page_list;		// Pages that have copies
+static int num_checkpoint_pages, max_checkpoint_pages;
+
+static checkpoint_input_t *checkpoint_inputs;
+static int num_checkpoint_inputs, max_checkpoint_inputs;
+
+void checkpoint_init(void)
+{
+    checkpoint_pages = calloc(MEM_NUM_PAGES, sizeof(checkpoint_page_t *));
+    ASSERT(checkpoint_pages);
+    mem_track_writes = 1;
+}
+
+void checkpoint_page_written(reg page)
+{
+    checkpoint_page_t **pp = &checkpoint_pages[MEM_PAGE(page)];
+
+    /*
+     * When instructions are run again, the page may already have been
+     * copied for this checkpoint.  Copies are kept newest first.
+     */
+    while (*pp && (*pp)->checkpoint > checkpoint_current) {
+        pp = &(*pp)->next;
+    }
+    if (*pp && (*pp)->checkpoint == checkpoint_current) {
+        return;
+    }
+
+    if (!checkpoint_pages[MEM_PAGE(page)]) {
+        if (num_checkpoint_pages == max_checkpoint_pages) {
+            max_checkpoint_pages = max_checkpoint_pages ? max_checkpoint_pages * 2 : 256;
+            checkpoint_page_list = realloc(checkpoint_page_list, max_checkpoint_pages * sizeof(reg));
+            ASSERT(checkpoint_page_list);
+        }
+        checkpoint_page_list[num_checkpoint_pages++] = page;
+    }
+
+    checkpoint_page_t *p = malloc(sizeof(checkpoint_page_t));
+    ASSERT(p);
+    p->checkpoint = checkpoint_current;
+    mem_copy_page(page, p->data, 0);
+    p->next = *pp;
+    *pp = p;
+}
+
+/*
+ * checkpoint_step()
+ *
+ * Called before each instruction.
+ */
+
+void checkpoint_step(void)
+{
+    if (checkpoint_count == checkpoint_next) {
+        int c = checkpoint_count / checkpoint_interval;
+
+        if (c == num_checkpoints) {
+            if (num_checkpoints == max_checkpoints) {
+                max_checkpoints = max_checkpoints ? max_checkpoints * 2 : 64;
+                checkpoints = realloc(checkpoints, max_checkpoints * sizeof(checkpoint_t));
+                ASSERT(checkpoints);
+            }
+            checkpoint_t *cp = &checkpoints[num_checkpoints++];
+            cp->count = checkpoint_count;
+            for (int i = 0; i < NUM_REGS; i++) {
+                cp->regs[i] = arm_get_reg(i);
+            }
+        }
+
+        checkpoint_current = c;
+        checkpoint_next += checkpoint_interval;
+        mem_clear_written();
+    }
+
+    checkpoint_replaying = checkpoint_count < checkpoint_high;
+    checkpoint_count++;
+    if (checkpoint_count > checkpoint_high) {
+        checkpoint_high = checkpoint_count;
+    }
+}
+
+static void checkpoint_restore(int c)
+{
+    checkpoint_t *cp = &checkpoints[c];
+
+    mem_track_writes = 0;
+    for (int i = 0; i < num_checkpoint_pages; i++) {
+        reg page = checkpoint_page_list[i];
+        checkpoint_page_t *p, *copy = NULL;
+
+        for (p = checkpoint_pages[MEM_PAGE(page)]; p && p->checkpoint >= c; p = p->next) {
+            copy = p;
+        }
+        if (copy) {
+            mem_copy_page(page, copy->data, 1);
+            icache_invalidate_range(page, MEM_PAGE_SIZE);
+        }
+    }
+    mem_track_writes = 1;
+    mem_clear_written();
+    forth_index_reset();
+
+    for (int i = 0; i < NUM_REGS; i++) {
+        arm_set_reg(i, cp->regs[i]);
+    }
+    checkpoint_count = cp->count;
+    checkpoint_next = cp->count;
+    checkpoint_current = c;
+    sim_done = 0;
+}
+
+/*
+ * checkpoint_goto()
+ *
+ * Put the machine where it was just before instruction number target.
+ * Returns the number of the instruction it got to, which is short of
+ * target if the program stopped first.
+ */
+
+uint64_t checkpoint_goto(uint64_t target)
+{
+    if (target < checkpoint_count) {
+        int c = target / checkpoint_interval;
+        if (c >= num_checkpoints) c = num_checkpoints - 1;
+        checkpoint_restore(c);
+    }
+
+    /*
+     * A sample falling due during the replay mustn't cut it short.
+     */
+    warn_disable++;
+    while (checkpoint_count < target && !(sim_done & ~SIM_SAMPLE)) {
+        if (!execute_one()) break;
+    }
+    warn_disable--;
+
+    return checkpoint_count;
+}
+
+/*
+ * Callback input
+ */
+
+void checkpoint_log_input(reg addr, reg len, reg result)
+{
+    if (num_checkpoint_inputs == max_checkpoint_inputs) {
+        max_checkpoint_inputs = max_checkpoint_inputs ? max_checkpoint_inputs * 2 : 64;
+        checkpoint_inputs = realloc(checkpoint_inputs, max_checkpoint_inputs * sizeof(checkpoint_input_t));
+        ASSERT(checkpoint_inputs);
+    }
+
+    checkpoint_input_t *in = &checkpoint_inputs[num_checkpoint_inputs++];
+    in->count = checkpoint_count - 1;
+    in->result = result;
+    in->addr = addr;
+    in->len = mem_range_is_valid(addr, len) ? len : 0;
+    in->data = malloc(in->len + 1);
+    ASSERT(in->data);
+    if (in->len) memcpy(in->data, memory_range(addr, len), len);
+}
+
+/*
+ * checkpoint_replay_input()
+ *
+ * Play back what a readline or getfile callback did the first time it
+ * ran.  Returns 0 if it wasn't logged.
+ */
+
+int checkpoint_replay_input(void)
+{
+    uint64_t count = checkpoint_count - 1;
+    int lo = 0, hi = num_checkpoint_inputs;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (checkpoint_inputs[mid].count < count) lo = mid + 1;
+        else                                       hi = mid;
+    }
+    if (lo == num_checkpoint_inputs || checkpoint_inputs[lo].count != count) {
+        return 0;
+    }
+
+    checkpoint_input_t *in = &checkpoint_inputs[lo];
+    if (in->len) {
+        mem_will_write(in->addr, in->len);
+        memcpy(memory_range(in->addr, in->len), in->data, in->len);
+        icache_invalidate_range(in->addr, in->len);
+    }
+    arm_set_reg(R0, in->result);
+
+    return 1;
+}
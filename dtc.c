@@ -7,6 +7,8 @@
 
 #include "sim.h"
 #include "arm.h"
+#include <unistd.h>
+#include <sys/stat.h>
 
 typedef reg	cell;
 
@@ -46,62 +48,204 @@ typedef struct forth_params_s {
 
 cell forth_readline(char *buffer, cell len);
 
-char *forth_lookup_word_name(reg cfa)
-{
-    if (cfa == dovar_addr) {
-        return strdup("dovar");
-    }
-
-    if (cfa == docolon_addr) {
-        return strdup("docolon");
-    }
-
-    if (cfa == docons_addr) {
-        return strdup("docons");
-    }
-
-    if (cfa == dodoes_addr) {
-        return strdup("dodoes");
-    }
+/*
+ * Is there a header (name and link) just before cfa?
+ */
 
+static int forth_has_name(reg cfa)
+{
     if (!mem_addr_is_valid(cfa)) {
-        return NULL;
+        return 0;
     }
 
     if (!mem_range_is_valid(cfa - 8, 12)) {
-        return NULL;
+        return 0;
     }
 
     reg link = mem_load(cfa, -4);
     if (link && !mem_range_is_valid(link, 4)) {
-        return NULL;
+        return 0;
     }
 
     byte len = mem_loadb(cfa, -5);
-    if (len > 128) {
-        return NULL;
+    if (len == 0 || len > 128) {
+        return 0;
     }
 
     reg strp = cfa-6;
     while (len-- > 0) {
         char c = mem_loadb(strp--, 0);
         if (!isprint(c)) {
-            return NULL;
+            return 0;
         }
     }
 
-    // Cache the names?
+    return 1;
+}
+
+/*
+ * Copy the name of the word at cfa into name, which holds at least 129
+ * bytes.  Returns 0 if there's no word there.
+ */
+
+static int forth_name(reg cfa, char *name)
+{
+    const char *machine = NULL;
 
-    strp = cfa - 5;
-    len = mem_loadb(strp--, 0);
-    char *str = malloc(len + 1);
-    str[len] = '\0';
+    if (!cfa) {
+        return 0;
+    }
+
+    if (cfa == dovar_addr) {
+        machine = "dovar";
+    } else if (cfa == docolon_addr) {
+        machine = "docolon";
+    } else if (cfa == docons_addr) {
+        machine = "docons";
+    } else if (cfa == dodoes_addr) {
+        machine = "dodoes";
+    }
+    if (machine) {
+        strcpy(name, machine);
+        return 1;
+    }
+
+    if (!forth_has_name(cfa)) {
+        return 0;
+    }
+
+    reg strp = cfa - 5;
+    byte len = mem_loadb(strp--, 0);
+    name[len] = '\0';
     while (len-- > 0) {
-        str[len] = mem_loadb(strp--, 0);
+        name[len] = mem_loadb(strp--, 0);
     }
+    return 1;
+}
+
+char *forth_lookup_word_name(reg cfa)
+{
+    char name[129];
+
+    if (!forth_name(cfa, name)) {
+        return NULL;
+    }
+
+    char *str = strdup(name);
+    ASSERT(str);
     return str;
 }
 
+/*
+ * The relocated image cache (-image-cache dir)
+ *
+ * Relocating the kernel touches every cell of it.  With -image-cache, the
+ * relocated kernel is written to dir/<image hash>-<base>.img, and later
+ * runs map that file into memory (see file_put_in_memory()) instead of
+ * relocating.  The name changes with the image, so an image that has
+ * changed is relocated again.
+ */
+
+char *image_cache;
+
+/*
+ * dir is relative to the current directory, not the Forth path, so the
+ * name is given a "./" for file_load().
+ */
+
+static char *forth_cache_path(file_t *file, reg base)
+{
+    char *path;
+    const char *dot = image_cache[0] == '/' || image_cache[0] == '.' ? "" : "./";
+
+    if (asprintf(&path, "%s%s/%016llx-%8.8x.img", dot, image_cache,
+                 (unsigned long long) file_hash(file), base) < 0) {
+        error("Out of memory");
+    }
+
+    return path;
+}
+
+static int forth_cache_load(file_t *file, reg base, reg size)
+{
+    char *path = forth_cache_path(file, base);
+    file_t *cached = file_load(path);
+
+    free(path);
+    if (!cached) return 0;
+
+    int ok = cached->image_size == size;
+    if (ok) file_put_in_memory(cached, base);
+    file_free(cached);
+
+    return ok;
+}
+
+static void forth_cache_save(file_t *file, reg base, reg size)
+{
+    char *path = forth_cache_path(file, base);
+    char *tmp;
+
+    if (asprintf(&tmp, "%s.%d", path, (int) getpid()) < 0) {
+        error("Out of memory");
+    }
+
+    (void) mkdir(image_cache, 0777);
+
+    FILE *fp = fopen(tmp, "w");
+    int ok = fp && fwrite(memory_range(base, size), 1, size, fp) == size;
+    if (fp && fclose(fp)) ok = 0;
+
+    // Renamed into place, so other runs never map half of it
+    if (!ok || rename(tmp, path)) {
+        warn("Couldn't write %s", path);
+        unlink(tmp);
+    }
+
+    free(tmp);
+    free(path);
+}
+
+/*
+ * Put the kernel in memory at base, adding base to each cell whose bit is
+ * set in the relocation bitmap.  If it all fits in memory, that's done in
+ * bulk (see reloc.c).
+ */
+
+static void forth_relocate(cell *kernel_image, cell kernel_ncells,
+                           cell *reloc_bitmap, cell reloc_ncells, reg base)
+{
+    // NOTE that only as many cells as the bitmap covers are put in memory.
+    reg ncells = (uint64_t) reloc_ncells * 32 < kernel_ncells ? reloc_ncells * 32 : kernel_ncells;
+    cell *dst = ncells ? memory_range(base, ncells * 4) : NULL;
+
+    if (dst) {
+        mem_will_write(base, ncells * 4);
+        reloc_apply(dst, kernel_image, reloc_bitmap, ncells, base);
+        icache_invalidate_range(base, ncells * 4);
+        return;
+    }
+
+    int offset = 0;
+    cell *p = kernel_image;
+    for (int i = 0; i < reloc_ncells; i++) {
+        cell bits = reloc_bitmap[i];
+        for (int j = 0; j < 32; j++) {
+            if (p == &kernel_image[kernel_ncells]) {
+                // NOTE that reloc_ncells/32 is possibly larger than kernel_ncells.
+                // This early exit prevents us from writing garbage beyond the end
+                // of the kernel.
+                break;
+            }
+
+            mem_store(base, offset, *p + ((bits & 1) ? base : 0));
+            p ++;
+            offset += 4;
+            bits >>= 1;
+        }
+    }
+}
+
 file_t *forth_init(char *filename, reg base, reg size)
 {
     file_t *forth_file;
@@ -141,23 +285,10 @@ file_t *forth_init(char *filename, reg base, reg size)
         error("The Forth image isn't compatible with this version of the simulator");
     }
 
-    int offset = 0;
-    cell *p = kernel_image;
-    for (int i = 0; i < reloc_ncells; i++) {
-        cell bits = reloc_bitmap[i];
-        for (int j = 0; j < 32; j++) {
-            if (p == &kernel_image[kernel_ncells]) {
-                // NOTE that reloc_ncells/32 is possibly larger than kernel_ncells.
-                // This early exit prevents us from writing garbage beyond the end
-                // of the kernel.
-                break;
-            }
-
-            mem_store(base, offset, *p + ((bits & 1) ? base : 0));
-            p ++;
-            offset += 4;
-            bits >>= 1;
-        }
+    int cache = image_cache && mem_range_is_valid(base, fsize);
+    if (!cache || !forth_cache_load(forth_file, base, fsize)) {
+        forth_relocate(kernel_image, kernel_ncells, reloc_bitmap, reloc_ncells, base);
+        if (cache) forth_cache_save(forth_file, base, fsize);
     }
 
 //  fp->sp0 = (void *) ((uintptr_t) base + size - (uintptr_t) fp->rp0 - 32);
@@ -175,9 +306,27 @@ file_t *forth_init(char *filename, reg base, reg size)
     mem_store(base, offsetof(forth_params_t, getfile_cb), 4);
     mem_store(base, offsetof(forth_params_t, sync_caches_cb), 5);
 
+    forth_index_init(base);
+
     return forth_file;
 }
 
+/*
+ * The stack bases forth_init() picked, for snapshots.
+ */
+
+void forth_stacks(reg *sp, reg *rp)
+{
+    *sp = sp0;
+    *rp = rp0;
+}
+
+void forth_set_stacks(reg sp, reg rp)
+{
+    sp0 = sp;
+    rp0 = rp;
+}
+
 reg forth_entry(file_t *file)
 {
     reg pc = mem_load(file->base, offsetof(forth_params_t, entry));
@@ -261,34 +410,39 @@ static int check_one_machine(reg addr, const reg *machine)
     return 1;
 }
 
-static char *forth_is_machinery(reg addr)
-{
-    const reg dovar[] = { 0xe52d6004, /* str     top, [sp, -4]! */
-                          0xe1a0600e, /* mov     top, lr        */
-                          0xe494f004, /* next                   */
-                          0
-    };
-
-    const reg docons[] = { 0xe52d6004, /* str     top, [sp, -4]! */
-                           0xe59e6000, /* ldr     top, [lr]      */
-                           0xe494f004, /* next                   */
-                           0
-    };
-
-    const reg docolon[] = { 0xe5254004, /* str     ip, [rp, -4]! */
-                            0xe1a0400e, /* mov     ip, lr        */
-                            0xe494f004, /* next                  */
-                            0
-    };
+/*
+ * muForth's machinery: the code that every word's code field branches to,
+ * and NEXT, which ends every code word.
+ */
 
-    const reg dodoes[] = { 0xe5254004, /* str     ip, [rp, -4]!  */
-                           0xe1a0400e, /* mov     ip, lr         */
-                           0xe52d6004, /* str     top, [sp, -4]! */
-                           0xe1a06000, /* mov     top, r0        */
-                           0xe494f004, /* next                   */
-                           0
-    };
+static const reg dovar[] = { 0xe52d6004, /* str     top, [sp, -4]! */
+                             0xe1a0600e, /* mov     top, lr        */
+                             NEXT,       /* next                   */
+                             0
+};
+
+static const reg docons[] = { 0xe52d6004, /* str     top, [sp, -4]! */
+                              0xe59e6000, /* ldr     top, [lr]      */
+                              NEXT,       /* next                   */
+                              0
+};
+
+static const reg docolon[] = { 0xe5254004, /* str     ip, [rp, -4]! */
+                               0xe1a0400e, /* mov     ip, lr        */
+                               NEXT,       /* next                  */
+                               0
+};
+
+static const reg dodoes[] = { 0xe5254004, /* str     ip, [rp, -4]!  */
+                              0xe1a0400e, /* mov     ip, lr         */
+                              0xe52d6004, /* str     top, [sp, -4]! */
+                              0xe1a06000, /* mov     top, r0        */
+                              NEXT,       /* next                   */
+                              0
+};
 
+static char *forth_is_machinery(reg addr)
+{
 #define CHECK(name)							\
     if (check_one_machine(addr, name)) {	\
         name ## _addr = addr;				\
@@ -303,6 +457,129 @@ static char *forth_is_machinery(reg addr)
     return NULL;
 }
 
+/*
+ * Fused machinery
+ *
+ * Nearly every Forth word runs one of the routines above and then NEXT.
+ * When forth_fuse is set, the icache entry at the start of a recognised
+ * routine runs the whole routine as one step, and a lone NEXT runs
+ * without going through the general LDR handler.  The register and
+ * memory effects are exactly those of the instructions, in order.
+ *
+ * A push can land on the routine itself (the stacks are ordinary
+ * memory).  That invalidates the entry, and the rest of the routine is
+ * then left to run one instruction at a time.
+ *
+ * Since a fused routine is a single step, fusing is off whenever each
+ * instruction has to be seen: tracing, backtraces and the undo log.
+ */
+
+int forth_fuse;
+
+static int forth_push(icache_entry_t *e, int sp_num, int reg_num)
+{
+    reg sp = r[sp_num] - 4;
+
+    undo_record_memory(sp);
+    mem_store(sp, 0, r[reg_num]);
+    undo_record_reg(sp_num);
+    r[sp_num] = sp;
+
+    return e->handler != NULL;
+}
+
+static int forth_next(icache_entry_t *e)
+{
+    reg ip = r[IP];
+
+    r[PC] = mem_load(ip, 0);
+    undo_record_reg(IP);
+    r[IP] = ip + 4;
+
+    return 1;
+}
+
+static int forth_dovar(icache_entry_t *e)
+{
+    if (!forth_push(e, SP, TOP)) return 1;
+    undo_record_reg(TOP);
+    r[TOP] = r[LR];
+    return forth_next(e);
+}
+
+static int forth_docons(icache_entry_t *e)
+{
+    if (!forth_push(e, SP, TOP)) return 1;
+    undo_record_reg(TOP);
+    r[TOP] = mem_load(r[LR], 0);
+    return forth_next(e);
+}
+
+static int forth_docolon(icache_entry_t *e)
+{
+    if (!forth_push(e, RP, IP)) return 1;
+    undo_record_reg(IP);
+    r[IP] = r[LR];
+    return forth_next(e);
+}
+
+static int forth_dodoes(icache_entry_t *e)
+{
+    if (!forth_push(e, RP, IP)) return 1;
+    undo_record_reg(IP);
+    r[IP] = r[LR];
+    if (!forth_push(e, SP, TOP)) {
+        r[PC] += 8;     // Resume at "mov top, r0"
+        return 1;
+    }
+    undo_record_reg(TOP);
+    r[TOP] = r[R0];
+    return forth_next(e);
+}
+
+/*
+ * forth_fuse_machinery()
+ *
+ * Called with a freshly decoded icache entry.  If the code at pc is one
+ * of the routines, point the entry at its fused handler and return
+ * non-zero.
+ */
+
+int forth_fuse_machinery(icache_entry_t *e, reg pc)
+{
+    static const struct {
+        const reg *code;
+        int len;
+        arm_handler_t handler;
+    } machines[] = {
+        { dovar,   3, forth_dovar   },
+        { docons,  3, forth_docons  },
+        { docolon, 3, forth_docolon },
+        { dodoes,  5, forth_dodoes  },
+    };
+
+    if (e->instr == NEXT) {
+        e->handler = forth_next;
+        return 1;
+    }
+
+    for (int i = 0; i < sizeof(machines) / sizeof(machines[0]); i++) {
+        reg len = machines[i].len * 4;
+
+        if (e->instr != machines[i].code[0]) continue;
+        if ((pc & ICACHE_PAGE_MASK) + len > ICACHE_PAGE_SIZE) continue;
+        if (!mem_range_is_valid(pc, len)) continue;
+
+        if (check_one_machine(pc, machines[i].code)) {
+            e->handler = machines[i].handler;
+            e->span = machines[i].len;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 
 reg forth_is_word(reg addr)
 {
@@ -313,7 +590,7 @@ reg forth_is_word(reg addr)
     }
         
     reg word = mem_load(addr, 0);
-    if (word == 0xe494f004) {
+    if (word == NEXT) {
         /*
          * Next
          */
@@ -387,22 +664,332 @@ reg forth_is_string(reg addr)
     return (4 + strlen + 3) >> 2;
 }
 
-void forth_word(reg ip)
+/*
+ * The symbol table
+ *
+ * Names to code fields, for the debugger (see forth_find_word()).  Every
+ * word put in the index below goes in this hash table too, keyed by name;
+ * a later word with the same name takes the place of an earlier one, as
+ * it does in the dictionary.  When words are dropped from the index, the
+ * table is made again from the index the next time it's needed.
+ */
+
+typedef struct forth_symbol_s {
+    uint64_t hash;
+    reg cfa;                // 0 if the slot is free
+} forth_symbol_t;
+
+static forth_symbol_t *forth_symbols;
+static int num_forth_symbols, max_forth_symbols;
+static int forth_symbols_stale;
+
+static void forth_symbols_clear(void)
+{
+    if (forth_symbols) memset(forth_symbols, 0, max_forth_symbols * sizeof(forth_symbol_t));
+    num_forth_symbols = 0;
+    forth_symbols_stale = 0;
+}
+
+static uint64_t forth_symbol_hash(const char *name)
 {
-    char *word_name = NULL;
+    return hash_bytes(HASH_INIT, name, strlen(name));
+}
+
+static void forth_symbol_insert(forth_symbol_t *table, int max, forth_symbol_t *sym)
+{
+    int h = sym->hash & (max - 1);
+
+    while (table[h].cfa) h = (h + 1) & (max - 1);
+    table[h] = *sym;
+}
+
+static void forth_symbol_add(reg cfa)
+{
+    char name[129], other[129];
+
+    if (!forth_name(cfa, name)) {
+        return;
+    }
 
-    if (mem_addr_is_valid(ip) && (ip & 3) == 0) {
-        word_name = forth_lookup_word_name(ip);
-        reg t = ip;
-        while (!word_name && mem_addr_is_valid(t)) {
-            t -= 4;
-            word_name = forth_lookup_word_name(t);
+    if (2 * (num_forth_symbols + 1) > max_forth_symbols) {
+        forth_symbol_t *old = forth_symbols;
+        int old_max = max_forth_symbols;
+
+        max_forth_symbols = max_forth_symbols ? max_forth_symbols * 2 : 1024;
+        forth_symbols = calloc(max_forth_symbols, sizeof(forth_symbol_t));
+        ASSERT(forth_symbols);
+
+        for (int i = 0; i < old_max; i++) {
+            if (old[i].cfa) forth_symbol_insert(forth_symbols, max_forth_symbols, &old[i]);
         }
-        if (word_name) {
-            printf("%s  ", word_name);
+        free(old);
+    }
+
+    forth_symbol_t sym = { forth_symbol_hash(name), cfa };
+    int h = sym.hash & (max_forth_symbols - 1);
+
+    for (; forth_symbols[h].cfa; h = (h + 1) & (max_forth_symbols - 1)) {
+        forth_symbol_t *s = &forth_symbols[h];
+        if (s->hash == sym.hash && forth_name(s->cfa, other) && !strcmp(name, other)) {
+            s->cfa = cfa;
             return;
         }
     }
+    forth_symbols[h] = sym;
+    num_forth_symbols++;
+}
+
+/*
+ * The word index
+ *
+ * Finding the word an address is in used to mean stepping back from it a
+ * cell at a time, asking at each cell whether a header ends there.
+ * Instead, the code fields of the named words are kept here in address
+ * order, and finding the word is a binary search.
+ *
+ * The index is filled by scanning for headers from the bottom of the
+ * memory the dictionary is in, and it covers the dictionary only up to the
+ * last word found: the guest may yet define words past that.  An address
+ * past the last word is found by scanning on from it, and the words found
+ * on the way are added.  A word whose header isn't there any more (it was
+ * forgotten, or the machine went back to an earlier state) is dropped,
+ * along with those after it, and the scan picks up from the word before.
+ */
+
+#define FORTH_INDEX_GAP		KB(64)	// The most space there can be between two words
+
+static reg *forth_index;
+static int num_forth_index, max_forth_index;
+static reg forth_index_base;		// Where the scan starts; 0 until it's found
+static reg forth_index_end;		// Scanned up to here
+
+/*
+ * Memory has changed under the index; start it again at the next lookup.
+ */
+
+void forth_index_reset(void)
+{
+    num_forth_index = 0;
+    forth_index_base = 0;
+    forth_symbols_stale = 1;
+    sample_reset();
+}
+
+/*
+ * The bottom of the memory addr is in.
+ */
+
+static reg forth_index_start(reg addr)
+{
+    reg page = addr & ~MEM_PAGE_MASK;
+
+    while (page >= MEM_PAGE_SIZE && mem_range_is_valid(page - MEM_PAGE_SIZE, MEM_PAGE_SIZE)) {
+        page -= MEM_PAGE_SIZE;
+    }
+
+    return page;
+}
+
+static void forth_index_add(reg cfa)
+{
+    if (num_forth_index == max_forth_index) {
+        max_forth_index = max_forth_index ? max_forth_index * 2 : 1024;
+        forth_index = realloc(forth_index, max_forth_index * sizeof(reg));
+        ASSERT(forth_index);
+    }
+    forth_index[num_forth_index++] = cfa;
+    forth_index_end = cfa + 4;
+
+    if (!forth_symbols_stale) forth_symbol_add(cfa);
+}
+
+/*
+ * Scan from from to to, inclusive, for headers.  With add, the words found
+ * go in the index.  Returns the last one found, or 0.
+ */
+
+static reg forth_index_scan(reg from, reg to, int add)
+{
+    reg last = 0;
+
+    for (reg t = from & ~3; ; t += 4) {
+        if (forth_has_name(t)) {
+            last = t;
+            if (add) forth_index_add(t);
+        }
+        if (t >= to) break;
+    }
+
+    return last;
+}
+
+/*
+ * Find the words defined since the last scan: scan on from the last word
+ * until FORTH_INDEX_GAP bytes go by without another one.
+ */
+
+static void forth_index_update(void)
+{
+    if (!forth_index_base) {
+        reg sp, rp;
+
+        forth_stacks(&sp, &rp);
+        forth_index_base = forth_index_start(rp);
+        forth_index_end = forth_index_base;
+        num_forth_index = 0;
+    }
+
+    reg last = forth_index_end;
+    for (reg t = forth_index_end; t - last < FORTH_INDEX_GAP && mem_addr_is_valid(t); t += 4) {
+        if (forth_has_name(t)) {
+            forth_index_add(t);
+            last = t;
+        }
+    }
+}
+
+/*
+ * forth_index_init()
+ *
+ * Index the dictionary in the image forth_init() just loaded at base.
+ */
+
+void forth_index_init(reg base)
+{
+    num_forth_index = 0;
+    forth_index_base = base;
+    forth_index_end = base;
+    forth_symbols_clear();
+    forth_index_update();
+}
+
+/*
+ * forth_find_word()
+ *
+ * The code field of the latest word called name, or 0 if there's none.
+ */
+
+reg forth_find_word(const char *name)
+{
+    char found[129];
+
+    forth_index_update();
+
+    if (forth_symbols_stale) {
+        forth_symbols_clear();
+        for (int i = 0; i < num_forth_index; i++) {
+            forth_symbol_add(forth_index[i]);
+        }
+    }
+
+    if (!num_forth_symbols) {
+        return 0;
+    }
+
+    uint64_t hash = forth_symbol_hash(name);
+    for (int h = hash & (max_forth_symbols - 1); forth_symbols[h].cfa; h = (h + 1) & (max_forth_symbols - 1)) {
+        forth_symbol_t *s = &forth_symbols[h];
+        if (s->hash == hash && forth_name(s->cfa, found) && !strcmp(name, found)) {
+            return s->cfa;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * forth_word_at()
+ *
+ * The code field of the word addr is in: the nearest named one at or
+ * before addr, looking back at most limit bytes.  0 if there's none.
+ */
+
+reg forth_word_at(reg addr, reg limit)
+{
+    reg cfa = 0;
+
+    addr &= ~3;
+    if (!addr || !mem_addr_is_valid(addr)) {
+        return 0;
+    }
+
+    if (!forth_index_base) {
+        forth_index_base = forth_index_start(addr);
+        forth_index_end = forth_index_base;
+        num_forth_index = 0;
+    }
+
+    if (addr < forth_index_base) {
+        // Not the dictionary's memory
+        reg from = forth_index_start(addr);
+        if (addr - from > limit) from = addr - limit;
+        cfa = forth_index_scan(from, addr, 0);
+    } else if (addr >= forth_index_end && addr - forth_index_end > limit) {
+        // Too far past the last word to scan from it
+        cfa = forth_index_scan(addr - limit, addr, 0);
+    } else {
+        for (;;) {
+            if (addr >= forth_index_end) {
+                forth_index_scan(forth_index_end, addr, 1);
+            }
+
+            int lo = 0, hi = num_forth_index;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (forth_index[mid] <= addr) lo = mid + 1;
+                else                          hi = mid;
+            }
+            if (!lo) {
+                cfa = 0;
+                break;
+            }
+
+            cfa = forth_index[lo - 1];
+            if (forth_has_name(cfa)) {
+                break;
+            }
+            num_forth_index = lo - 1;
+            forth_index_end = num_forth_index ? forth_index[num_forth_index - 1] + 4 : forth_index_base;
+            forth_symbols_stale = 1;
+        }
+    }
+
+    reg machinery[] = { dovar_addr, docolon_addr, docons_addr, dodoes_addr };
+    for (int i = 0; i < 4; i++) {
+        if (machinery[i] && machinery[i] <= addr && machinery[i] > cfa) {
+            cfa = machinery[i];
+        }
+    }
+
+    if (!cfa || addr - cfa > limit) {
+        return 0;
+    }
+
+    return cfa;
+}
+
+/*
+ * Is the stack between p and its base p0 in memory?  p is past p0 when
+ * the stack is empty.
+ */
+
+static int forth_stack_is_valid(reg p, reg p0)
+{
+    if (p > p0) {
+        return mem_range_is_valid(p0, p - p0);
+    }
+
+    return mem_range_is_valid(p, p0 - p);
+}
+
+void forth_word(reg ip)
+{
+    char name[129];
+
+    if (mem_addr_is_valid(ip) && (ip & 3) == 0 && forth_name(forth_word_at(ip, ~0), name)) {
+        printf("%s  ", name);
+        return;
+    }
 
     printf("%8.8x  ", ip);
 }
@@ -411,19 +998,14 @@ void forth_backtrace(void)
 {
     cell rp = arm_get_reg(RP);
 
-    if (!mem_range_is_valid(rp, rp0 - rp)) return;
+    if (!forth_stack_is_valid(rp, rp0)) return;
 
-    char *word_name = forth_lookup_word_name(arm_get_reg(PC));
-    if (word_name) {
-        if (strcmp(word_name, "^") == 0) {
-            return;
-        }
-        printf("Back trace: ");
-        printf("%s  ", word_name);
-        free(word_name);
-    } else {
+    char name[129];
+    if (!forth_name(arm_get_reg(PC), name) || strcmp(name, "^") == 0) {
         return;
     }
+    printf("Back trace: ");
+    printf("%s  ", name);
 
     forth_word(arm_get_reg(IP));
 
@@ -439,7 +1021,7 @@ void forth_show_stack(void)
 {
     cell sp = arm_get_reg(SP);  // Skip DECAFBAD that's been pushed
 
-    if (!mem_range_is_valid(sp, sp0 - sp)) return;
+    if (!forth_stack_is_valid(sp, sp0)) return;
 
     cell top = arm_get_reg(TOP);
     if (top == 0xDECAFBAD) {
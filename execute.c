@@ -29,7 +29,7 @@ void init_execution(void)
     arm_set_reg(FLAGS, 0x0);
 }
 
-static reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift, reg *carry_out)
+reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift, reg *carry_out)
 {
     reg result;
     reg result_carry;
@@ -44,7 +44,7 @@ static reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift,
             result = base << shift;
         } else {
             result = base;
-            result_carry = (arm_get_reg(FLAGS) & C) >> C_SHIFT;
+            result_carry = arm_flag_c();
         }
         break;
     case 1:  // LSR
@@ -82,7 +82,7 @@ static reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift,
             /*
              * RRX: shift right one bit and insert the carry
              */
-            reg carry_in = (arm_get_reg(FLAGS) & C) >> C_SHIFT;
+            reg carry_in = arm_flag_c();
             result = carry_in << 31 | base >> 1;
             result_carry = base;
         }
@@ -99,18 +99,20 @@ static reg barrel_shifter(reg is_reg_shift, reg base, reg shift_type, reg shift,
     return result;
 }
 
-static int execute_check_conds(reg conds)
+int execute_check_conds(reg conds)
 {
-    reg flags = arm_get_reg(FLAGS);
+    /*
+     * Only the flags a condition looks at are worked out (see arm.h).
+     */
 
-#define C_CLR       CLR(flags & C)
-#define C_SET       SET(flags & C)
-#define Z_CLR       CLR(flags & Z)
-#define Z_SET       SET(flags & Z)
-#define N_CLR       CLR(flags & N)
-#define N_SET       SET(flags & N)
-#define V_CLR       CLR(flags & V)
-#define V_SET       SET(flags & V)
+#define C_CLR       CLR(arm_flag_c())
+#define C_SET       SET(arm_flag_c())
+#define Z_CLR       CLR(arm_flag_z())
+#define Z_SET       SET(arm_flag_z())
+#define N_CLR       CLR(arm_flag_n())
+#define N_SET       SET(arm_flag_n())
+#define V_CLR       CLR(arm_flag_v())
+#define V_SET       SET(arm_flag_v())
 
     switch (conds & 0xF) {
     case 0:  return Z_SET;
@@ -155,184 +157,399 @@ extern int interactive, quiet;
 
 int execute_callbacks(reg pc)
 {
+    reg buffer = arm_get_reg(R0), len = arm_get_reg(R1);
+
+    if (pc == 3 && snapshot_booting) {
+        snapshot_boot_save();   // The boot is done; see snapshot.c
+    }
+    if (pc == 3 && batch_list) {
+        batch_start();          // Returns with the first job's input
+    }
+
     undo_record_reg(PC);
     arm_set_reg(PC, arm_get_reg(LR));
 
+    /*
+     * A callback that checkpoint_goto() runs again doesn't read or write
+     * again; what it read the first time is played back.
+     */
+    if (checkpoint_replaying &&
+        (pc == 2 || pc == 5 || ((pc == 3 || pc == 4) && checkpoint_replay_input()))) {
+        undo_finish_instr();
+        return 1;
+    }
+
     switch (pc) {
     case 1: sim_done = 1; break;
-    case 2: io_write(arm_get_reg(R0), arm_get_reg(R1)); break;
-    case 3: undo_record_reg(R0); arm_set_reg(R0, io_readline(arm_get_reg(R0), arm_get_reg(R1))); debug_if(0); break;
-    case 4: undo_record_reg(R0); arm_set_reg(R0, io_readfile(arm_get_reg(R0), arm_get_reg(R1))); break;
+    case 2: io_write(buffer, len); break;
+    case 3: undo_record_reg(R0); arm_set_reg(R0, io_readline(buffer, len)); debug_if(0); break;
+    case 4: undo_record_reg(R0); arm_set_reg(R0, io_readfile(buffer, len)); break;
     case 5: /* Nothing to do for sync caches */ break;
     }
 
+    if (checkpoint_interval) {
+        reg result = arm_get_reg(R0);
+        if (pc == 3) checkpoint_log_input(buffer, len, result);
+        if (pc == 4) checkpoint_log_input(result, result ? 4 + mem_load(result, 0) : 0, result);
+    }
+
+    undo_finish_instr();
+
     return 1;
 }
 
-int execute_one(void)
+/*
+ * Instruction handlers
+ *
+ * Each handler executes one class of instruction from its predecoded
+ * icache entry.  By the time a handler runs, execute_one() has already
+ * stepped the PC past the instruction and checked its condition.
+ */
+
+static int execute_b(icache_entry_t *e)
 {
-    reg pc = arm_get_reg(PC);
+    if (e->link) {
+        undo_record_reg(LR);
+        arm_set_reg(LR, arm_get_reg(PC));
+    }
+    arm_set_reg(PC, e->imm);
 
-    if (pc > 0 && pc < 6) {
-        return execute_callbacks(pc);
+    return 1;
+}
+
+int execute_ldr(icache_entry_t *e)
+{
+    reg maddr, offset, m;
+
+    if (e->imm_form) {
+        offset = e->imm;
+    } else {
+        m = arm_get_reg(e->rm);
+        if (m == PC) m += 4;
+        offset = barrel_shifter(FALSE, m, e->shift_type, e->shift, NULL);
     }
 
-    reg instr = mem_load(pc, 0);
-    
-    if (instr == BAD_MEMVAL) {
-        return 0;
+    maddr = arm_get_reg(e->rn);
+    if (e->rn == PC) maddr += 4;
+    if (e->pre_post) maddr += offset;
+    undo_record_reg(e->rd);
+    if (!e->byte_xfer) {
+        arm_set_reg(e->rd, mem_load(maddr, 0));
+    } else {
+        arm_set_reg(e->rd, mem_loadb(maddr, 0));
+    }
+    if (e->write_back || !e->pre_post) {
+        if (!e->pre_post) maddr += offset;
+        undo_record_reg(e->rn);
+        arm_set_reg(e->rn, maddr);
     }
 
-    arm_instr_t op = arm_decode_instr(instr);
-    reg cond = IBITS(28, 4);
-    reg rm = IBITS(0, 4);
-    reg rs = IBITS(8, 4);
-    reg rd = IBITS(12, 4);
-    reg rn = IBITS(16, 4);
-    reg up_down = IBIT(23);
-    reg pre_post = IBIT(24);
-    reg write_back = IBIT(21);
-    reg imm12bit = IBITS(0, 12);
-    reg imm5shift = IBITS(7, 5);
-    reg imm8bit = IBITS(0, 8);
-    reg imm_rot  = IBITS(8, 4);
-    reg shift_type = IBITS(5, 2);
-    reg setconds = IBIT(20);
+    return 1;
+}
+
+int execute_str(icache_entry_t *e)
+{
     reg maddr, offset;
-    reg d, n, m, s;
-    uint64_t d64, n64, m64, s64;
-    reg c, z, v, nc;
-    reg step;
+
+    if (e->imm_form) {
+        offset = e->imm;
+    } else {
+        offset = barrel_shifter(FALSE, arm_get_reg(e->rm), e->shift_type, e->shift, NULL);
+    }
+
+    maddr = arm_get_reg(e->rn);
+    if (e->rn == PC) maddr += 4;
+    if (e->pre_post) maddr += offset;
+    if (!e->byte_xfer) {
+        undo_record_memory(maddr);
+        mem_store(maddr, 0, arm_get_reg(e->rd));
+    } else {
+        undo_record_byte(maddr);
+        mem_storeb(maddr, 0, arm_get_reg(e->rd));
+    }
+    if (e->write_back || !e->pre_post) {
+        if (!e->pre_post) maddr += offset;
+        undo_record_reg(e->rn);
+        arm_set_reg(e->rn, maddr);
+    }
+
+    return 1;
+}
+
+int execute_ldm(icache_entry_t *e)
+{
+    reg instr = e->instr;
+    reg maddr = arm_get_reg(e->rn);
+    reg rm, step;
+
+    if (e->up_down) {
+        rm = 0;
+        step = 1;
+    } else {
+        rm = 15;
+        step = -1;
+    }
+    for (reg count = 0; count < 16; count++, rm += step) {
+        if (IBIT(rm)) {
+            maddr = pre_inc(maddr, e->pre_post, e->up_down);
+            if (rm != e->rn || !e->write_back) undo_record_reg(rm);
+            arm_set_reg(rm, mem_load(maddr, 0));
+            maddr = post_inc(maddr, e->pre_post, e->up_down);
+        }
+    }
+
+    if (e->write_back) {
+        undo_record_reg(e->rn);
+        arm_set_reg(e->rn, maddr);
+    }
+
+    return 1;
+}
+
+int execute_stm(icache_entry_t *e)
+{
+    reg instr = e->instr;
+    reg maddr = arm_get_reg(e->rn);
+    reg rm, step;
 
     /*
-     * Most instructions step forward one instruction
-     * Branch doesn't (necessarily) but it handles it's own case below.
+     * The words stored are recorded for undo as one range.
      */
-    undo_record_reg(PC);
-    arm_set_reg(PC, pc + 4);
+    if (!undo_disable) {
+        reg words = 0, first;
 
-    if (!execute_check_conds(cond)) {
-        undo_finish_instr();
-        return 1;
+        for (rm = 0; rm < 16; rm++) words += IBIT(rm);
+        if (e->up_down) first = maddr + (e->pre_post ? 4 : 0);
+        else            first = maddr - words * 4 + (e->pre_post ? 0 : 4);
+        undo_record_range(first, words * 4);
     }
 
-    switch (op) {
-    case ARM_INSTR_B:
-    {
-        reg imm24bit = IBITS(0, 24);
-        reg dest = decode_dest_addr(pc, imm24bit, 24, 0);
-        if (IBIT(24)) {
-            undo_record_reg(LR);
-            arm_set_reg(LR, arm_get_reg(PC));
+    if (e->up_down) {
+        rm = 0;
+        step = 1;
+    } else {
+        rm = 15;
+        step = -1;
+    }
+    for (reg count = 0; count < 16; count++, rm += step) {
+        if (IBIT(rm)) {
+            maddr = pre_inc(maddr, e->pre_post, e->up_down);
+            mem_store(maddr, 0, arm_get_reg(rm));
+            maddr = post_inc(maddr, e->pre_post, e->up_down);
         }
-        arm_set_reg(PC, dest);
-        break;
     }
 
-    case ARM_INSTR_LDR:
-        if (!IBIT(25)) {
-            if (up_down) offset =  imm12bit;
-            else         offset = -imm12bit;
-        } else {
-            m = arm_get_reg(rm);
-            if (m == PC) m += 4;
-            offset = barrel_shifter(FALSE, m, shift_type, imm5shift, NULL);
-        }
+    if (e->write_back) {
+        undo_record_reg(e->rn);
+        arm_set_reg(e->rn, maddr);
+    }
 
-        maddr = arm_get_reg(rn);
-        if (rn == PC) maddr += 4;
-        if (pre_post) maddr += offset;
-        undo_record_reg(rd);
-        if (!IBIT(22)) {
-            arm_set_reg(rd, mem_load(maddr, 0));
+    return 1;
+}
+
+static int execute_dp(icache_entry_t *e)
+{
+    arm_instr_t op = e->op;
+    reg rd = e->rd;
+    reg d, n, m;
+    reg nc;
+
+    n = arm_get_reg(e->rn);
+    if (e->rn == PC) n += 4;
+
+    if (e->imm_form) {
+        m = e->imm;
+        nc = e->imm_carry;
+    } else {
+        m = arm_get_reg(e->rm);
+        if (!e->reg_shift) {
+            if (e->rm == PC) m += 4;
+            m = barrel_shifter(FALSE, m, e->shift_type, e->shift, &nc);
         } else {
-            arm_set_reg(rd, mem_loadb(maddr, 0));
+            if (e->rm == PC) m += 8;
+            reg s = arm_get_reg(e->rs);
+            if (e->rs == PC) s += 8;
+            s &= 0xFF;  // Only one byte of register is used
+            m = barrel_shifter(TRUE, m, e->shift_type, s, &nc);
         }
-        if (write_back || !pre_post) {
-            if (!pre_post) maddr += offset;
-            undo_record_reg(rn);
-            arm_set_reg(rn, maddr);
+    }
+
+    switch (op) {
+    case ARM_INSTR_AND:         d = n & m    ; break;
+    case ARM_INSTR_EOR:         d = n ^ m    ; break;
+    case ARM_INSTR_SUB: m = ~m; d = n + m + 1; break;
+    case ARM_INSTR_RSB: n = ~n; d = m + n + 1; break;
+    case ARM_INSTR_ADD:         d = n + m    ; break;
+    case ARM_INSTR_ADC: m =  m; d = n + m + arm_flag_c(); break;
+    case ARM_INSTR_SBC: m = ~m; d = n + m + arm_flag_c(); break;
+    case ARM_INSTR_RSC: n = ~n; d = m + n + arm_flag_c(); break;
+    case ARM_INSTR_TST:         d = n & m    ; break;
+    case ARM_INSTR_TEQ:         d = n ^ m    ; break;
+    case ARM_INSTR_CMP: m = ~m; d = n + m + 1; break;
+    case ARM_INSTR_CMN:         d = n + m    ; break;
+    case ARM_INSTR_ORR:         d = n | m    ; break;
+    case ARM_INSTR_MOV:         d =     m    ; break;
+    case ARM_INSTR_BIC: m = ~m; d = n & m    ; break;
+    case ARM_INSTR_MVN: m = ~m; d =     m    ; break;
+    default:                    d =0xEEBADADD; break;
+    }
+
+    switch (op) {
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        if (e->setconds && rd != PC) {
+            /*
+             * N and Z from d; C := carry out from the barrel shifter, or
+             * C if shift is LSL #0 (handled by the barrel shift logic);
+             * V := V.
+             */
+            undo_record_reg(FLAGS);
+            arm_flags_logic(d, nc, arm_flag_v());
         }
         break;
 
-    case ARM_INSTR_STR:
-        if (!IBIT(25)) {
-            if (up_down) offset =  imm12bit;
-            else         offset = -imm12bit;
-        } else {
-            m = arm_get_reg(rm);
-            if (m == PC) m += 4;
-            offset = barrel_shifter(FALSE, arm_get_reg(rm), shift_type, imm5shift, NULL);
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_RSB:
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+    case ARM_INSTR_CMP:
+    case ARM_INSTR_CMN:
+        if (e->setconds && rd != PC) {
+            /*
+             * N, Z, C (the carry out of the ALU) and V (set when both
+             * operands have the same sign and the result doesn't) all
+             * follow from n, m and d; see arm_flag_c() and arm_flag_v().
+             */
+            undo_record_reg(FLAGS);
+            arm_flags_arith(n, m, d);
         }
+        break;
+    default: break;
+    }
 
-        maddr = arm_get_reg(rn);
-        if (rn == PC) maddr += 4;
-        if (pre_post) maddr += offset;
-        if (!IBIT(22)) {
-            undo_record_memory(maddr);
-            mem_store(maddr, 0, arm_get_reg(rd));
-        } else {
-            undo_record_byte(maddr);
-            mem_storeb(maddr, 0, arm_get_reg(rd));
-        }
-        if (write_back || !pre_post) {
-            if (!pre_post) maddr += offset;
-            undo_record_reg(rn);
-            arm_set_reg(rn, maddr);
-        }
+    switch (op) {
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_RSB:
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        undo_record_reg(rd);
+        arm_set_reg(rd, d);
         break;
+    default: break;
+    }
 
-    case ARM_INSTR_LDM:
-        maddr = arm_get_reg(rn);
+    return 1;
+}
 
-        if (up_down) {
-            rm = 0;
-            step = 1;
-        } else {
-            rm = 15;
-            step = -1;
-        }
-        for (reg count = 0; count < 16; count++, rm += step) {
-            if (IBIT(rm)) {
-                maddr = pre_inc(maddr, pre_post, up_down);
-                if (rm != rn || !write_back) undo_record_reg(rm);
-                arm_set_reg(rm, mem_load(maddr, 0));
-                maddr = post_inc(maddr, pre_post, up_down);
-            }
-        }
+int execute_mul(icache_entry_t *e)
+{
+    reg instr = e->instr;
+    reg d, n, m, s;
+    reg c, z, v;
 
-        if (write_back) {
-            undo_record_reg(rn);
-            arm_set_reg(rn, maddr);
-        }
-        break;
+    m = arm_get_reg(e->rm);
+    s = arm_get_reg(e->rs);
 
-    case ARM_INSTR_STM:
-        maddr = arm_get_reg(rn);
+    d = m * s;
+    if (IBIT(21)) {
+        n = arm_get_reg(e->rn);
+        d += n;
+    }
+    undo_record_reg(e->rd);
+    arm_set_reg(e->rd, d);
+    if (IBIT(20)) {
+        v = TF(arm_get_reg(FLAGS) >> V_SHIFT);
+        c = 0;
+        z = d == 0;
+        n = SIGN(d);
+        undo_record_reg(FLAGS);
+        arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
+    }
 
-        if (up_down) {
-            rm = 0;
-            step = 1;
-        } else {
-            rm = 15;
-            step = -1;
-        }
-        for (reg count = 0; count < 16; count++, rm += step) {
-            if (IBIT(rm)) {
-                maddr = pre_inc(maddr, pre_post, up_down);
-                reg m = arm_get_reg(rm);
-                if (rm == PC) m += 8;
-                undo_record_memory(maddr);
-                mem_store(maddr, 0, arm_get_reg(rm));
-                maddr = post_inc(maddr, pre_post, up_down);
-            }
-        }
+    return 1;
+}
 
-        if (write_back) {
-            undo_record_reg(rn);
-            arm_set_reg(rn, maddr);
-        }
-        break;
+int execute_mull(icache_entry_t *e)
+{
+    reg instr = e->instr;
+    reg rd = e->rd, rn = e->rn;
+    reg m, s;
+    uint64_t d64, n64, m64, s64;
+    reg c, z, v, n;
+
+    m = arm_get_reg(e->rm);
+    s = arm_get_reg(e->rs);
+
+    if (IBIT(22)) {
+        m64 = SEXT(m);
+        s64 = SEXT(s);
+    } else {
+        m64 = m;
+        s64 = s;
+    }
+
+    d64 = m64 * s64;
+    if (IBIT(21)) {
+        n64 = ((uint64_t)arm_get_reg(rd) << 32) | arm_get_reg(rn);
+        d64 += n64;
+    }
+
+    undo_record_reg(rd);
+    undo_record_reg(rn);
+    arm_set_reg(rd, d64 >> 32);
+    arm_set_reg(rn, d64);
+
+    if (IBIT(20)) {
+        v = 0;
+        c = 0;
+        z = d64 == 0;
+        n = SIGN64(d64);
+        undo_record_reg(FLAGS);
+        arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
+    }
+
+    return 1;
+}
+
+static int execute_illegal(icache_entry_t *e)
+{
+    warn("Unimplemented instruction: %8.8x", e->instr);
+    return 0;
+}
+
+int execute_engine;
+
+arm_handler_t execute_handler(icache_entry_t *e)
+{
+    if (execute_engine != EXECUTE_ENGINE_INTERP) {
+        arm_handler_t h = threaded_handler(e);
+        if (h) return h;
+    }
+
+    switch (e->op) {
+    case ARM_INSTR_B:    return execute_b;
+    case ARM_INSTR_LDR:  return execute_ldr;
+    case ARM_INSTR_STR:  return execute_str;
+    case ARM_INSTR_LDM:  return execute_ldm;
+    case ARM_INSTR_STM:  return execute_stm;
+    case ARM_INSTR_MUL:  return execute_mul;
+    case ARM_INSTR_MULL: return execute_mull;
 
     case ARM_INSTR_AND:
     case ARM_INSTR_EOR:
@@ -350,211 +567,53 @@ int execute_one(void)
     case ARM_INSTR_MOV:
     case ARM_INSTR_BIC:
     case ARM_INSTR_MVN:
-        if (op == ARM_INSTR_TST ||
-            op == ARM_INSTR_TEQ ||
-            op == ARM_INSTR_CMP ||
-            op == ARM_INSTR_CMN) {
-            setconds = 1;
-        }
-
-        reg flags = arm_get_reg(FLAGS);
-        n = arm_get_reg(rn);
-        if (rn == PC) n += 4;
-
-        if (IBIT(25)) {
-            m = imm8bit << (imm_rot << 1);
-            if (imm_rot > 0) {
-                nc = (imm8bit << ((imm_rot << 1) -1)) >> 31;
-            } else {
-                nc = imm8bit & 1;  // XXX: Is this right? 
-            }
-        } else {
-            m = arm_get_reg(rm);
-            if (!IBIT(4)) {
-                if (rm == PC) m += 4;
-                m = barrel_shifter(FALSE, m, shift_type, imm5shift, &nc);
-            } else {
-                if (rm == PC) m += 8;
-                reg s = arm_get_reg(rs);
-                if (rs == PC) s += 8;
-                s &= 0xFF;  // Only one byte of register is used
-                m = barrel_shifter(TRUE, m, shift_type, s, &nc);
-            }
-        }
-
-        c = (arm_get_reg(FLAGS) & C) >> C_SHIFT;
-        switch (op) {
-        case ARM_INSTR_AND:         d = n & m    ; break;
-        case ARM_INSTR_EOR:         d = n ^ m    ; break;
-        case ARM_INSTR_SUB: m = ~m; d = n + m + 1; break;
-        case ARM_INSTR_RSB: n = ~n; d = m + n + 1; break;
-        case ARM_INSTR_ADD:         d = n + m    ; break;
-        case ARM_INSTR_ADC: m =  m; d = n + m + c; break;
-        case ARM_INSTR_SBC: m = ~m; d = n + m + c; break;
-        case ARM_INSTR_RSC: n = ~n; d = m + n + c; break;
-        case ARM_INSTR_TST:         d = n & m    ; break;
-        case ARM_INSTR_TEQ:         d = n ^ m    ; break;
-        case ARM_INSTR_CMP: m = ~m; d = n + m + 1; break;
-        case ARM_INSTR_CMN:         d = n + m    ; break;
-        case ARM_INSTR_ORR:         d = n | m    ; break;
-        case ARM_INSTR_MOV:         d =     m    ; break;
-        case ARM_INSTR_BIC: m = ~m; d = n & m    ; break;
-        case ARM_INSTR_MVN: m = ~m; d =     m    ; break;
-        default:                    d =0xEEBADADD; break;
-        }
+        return execute_dp;
 
-        switch (op) {
-        case ARM_INSTR_AND:
-        case ARM_INSTR_EOR:
-        case ARM_INSTR_TST:
-        case ARM_INSTR_TEQ:
-        case ARM_INSTR_ORR:
-        case ARM_INSTR_MOV:
-        case ARM_INSTR_BIC:
-        case ARM_INSTR_MVN:
-            if (setconds && rd != PC) {
-                // V := V
-                v = (flags & V) >> V_SHIFT;
-                // C := carry out from the barrel shifter, or C if shift is LSL #0
-                c = nc;  // LSL #0 handled by barrel shift logic
-                // Z := if d == 0
-                z = d == 0;
-                // N := if d & (1<<31)
-                n = SIGN(d);
-
-                undo_record_reg(FLAGS);
-                arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
-            }
-            break;
-
-        case ARM_INSTR_SUB:
-        case ARM_INSTR_RSB:
-        case ARM_INSTR_ADD:
-        case ARM_INSTR_ADC:
-        case ARM_INSTR_SBC:
-        case ARM_INSTR_RSC:
-        case ARM_INSTR_CMP:
-        case ARM_INSTR_CMN:
-            if (setconds && rd != PC) {
-                if (!SIGN(n ^ m)) {
-                    /*
-                     * If the signs of the two operands are the same, then
-                     * the overflow bit is set when the result has a sign
-                     * different from either of the operands.
-                     */
-                    v = TF(SIGN(d ^ m));
-                } else {
-                    /*
-                     * If the signs of the two operands are different, then
-                     * there isn't any possibility of an overflow.
-                     */
-                    v = 0;
-                }
-                // C := carry out of the ALU
-                if (SIGN(n) && SIGN(m)) {
-                    c = 1;
-                } else if (SIGN(n | m)) {
-                    c = !(SIGN(d));
-                } else {
-                    c = 0;
-                }
-                // Z := if d == 0
-                z = d == 0;
-                // N := if d & (1<<31)
-                n = TF(SIGN(d));
-
-                undo_record_reg(FLAGS);
-                arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
-            }
-            break;
-        default: break;
-        }
-
-        switch (op) {
-        case ARM_INSTR_AND:
-        case ARM_INSTR_EOR:
-        case ARM_INSTR_SUB:
-        case ARM_INSTR_RSB:
-        case ARM_INSTR_ADD:
-        case ARM_INSTR_ADC:
-        case ARM_INSTR_SBC:
-        case ARM_INSTR_RSC:
-        case ARM_INSTR_ORR:
-        case ARM_INSTR_MOV:
-        case ARM_INSTR_BIC:
-        case ARM_INSTR_MVN:
-            undo_record_reg(rd);
-            arm_set_reg(rd, d);
-            break;
-        default: break;
-        }
-        break;
+    default:
+        return execute_illegal;
+    }
+}
 
-    case ARM_INSTR_MUL:
-        SWAP(rd, rn);
+int execute_one(void)
+{
+    reg pc = arm_get_reg(PC);
+    icache_entry_t *e, decoded;
 
-        m = arm_get_reg(rm);
-        s = arm_get_reg(rs);
+    if (checkpoint_interval) checkpoint_step();
 
-        d = m * s;
-        if (IBIT(21)) {
-            n = arm_get_reg(rn);
-            d += n;
-        }
-        undo_record_reg(rd);
-        arm_set_reg(rd, d);
-        if (IBIT(20)) {
-            v = TF(arm_get_reg(FLAGS) >> V_SHIFT);
-            c = 0;
-            z = d == 0;
-            n = SIGN(d);
-            undo_record_reg(FLAGS);
-            arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
-        }
-        break;
-
-    case ARM_INSTR_MULL:
-        SWAP(rd, rn);
-        
-        m = arm_get_reg(rm);
-        s = arm_get_reg(rs);
+    if (pc > 0 && pc < 6) {
+        return execute_callbacks(pc);
+    }
 
-        if (IBIT(22)) {
-            m64 = SEXT(m);
-            s64 = SEXT(s);
-        } else {
-            m64 = m;
-            s64 = s;
+    if (!icache_disable) {
+        e = icache_lookup(pc);
+        if (!e) {
+            return 0;
         }
-
-        d64 = m64 * s64;
-        if (IBIT(21)) {
-            n64 = ((uint64_t)arm_get_reg(rd) << 32) | arm_get_reg(rn);
-            d64 += n64;
+    } else {
+        reg instr = mem_load(pc, 0);
+        if (instr == BAD_MEMVAL) {
+            return 0;
         }
+        e = &decoded;
+        icache_predecode(e, pc, instr);
+    }
 
-        undo_record_reg(rd);
-        undo_record_reg(rn);
-        arm_set_reg(rd, d64 >> 32);
-        arm_set_reg(rn, d64);
-
-        if (IBIT(20)) {
-            v = 0;
-            c = 0;
-            z = d64 == 0;
-            n = SIGN64(d64);
-            undo_record_reg(FLAGS);
-            arm_set_reg(FLAGS, z << Z_SHIFT | v << V_SHIFT | n << N_SHIFT | c << C_SHIFT);
-        }
-        break;
+    /*
+     * Most instructions step forward one instruction
+     * Branch doesn't (necessarily) but it handles it's own case below.
+     */
+    undo_record_reg(PC);
+    arm_set_reg(PC, pc + 4);
 
-    default:
+    if (!execute_check_conds(e->cond)) {
         undo_finish_instr();
-        warn("Unimplemented instruction: %8.8x", instr);
-        return 0;
+        return 1;
     }
 
+    int ok = e->handler(e);
+
     undo_finish_instr();
 
-    return 1;
+    return ok;
 }
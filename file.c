@@ -6,6 +6,11 @@
  */
 
 #include "sim.h"
+#include "arm.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 char *forth_path;
 
@@ -13,6 +18,7 @@ file_t *file_load(char *file_name)
 {
     char *fname;
     file_t *file;
+    int fd;
 
     if (file_name[0] == '/' || file_name[0] == '.') {
         asprintf(&fname, "%s", file_name);
@@ -28,62 +34,92 @@ file_t *file_load(char *file_name)
     if (!file) return NULL;
 
     file->name = fname;
-    file->fp = NULL;
     file->image = NULL;
     file->image_size = 0;
     file->base = 0;
     file->size = 0;
 
-    file->fp = fopen(file->name, "r");
-    if (!file->fp) {
-        goto err;
-    }
+    /*
+     * The image is the file mapped read only, not a copy of it.
+     */
+
+    struct stat st;
 
-    if (fseek(file->fp, 0, SEEK_END)) {
+    fd = open(file->name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
         goto err;
     }
 
-    file->image_size = ftell(file->fp);
-
-    file->image = malloc(file->image_size);
-    ASSERT(file->image);
-
-    if (fseek(file->fp, 0, SEEK_SET)) {
+    file->image_size = st.st_size;
+    if (!file->image_size) {
         goto err;
     }
 
-    if (!fread(file->image, 1, file->image_size, file->fp)) {
+    file->image = mmap(NULL, file->image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->image == MAP_FAILED) {
+        file->image = NULL;
         goto err;
     }
-
-    fclose(file->fp);
-    file->fp = NULL;
+    close(fd);
 
     return file;
 
 err:
+    if (fd >= 0) close(fd);
     file_free(file);
     return NULL;
 }
 
+/*
+ * file_put_in_memory()
+ *
+ * The file is copied into memory in one go, or byte by byte if it runs
+ * off the end of memory.  Guest memory never shares pages with the file,
+ * so the file can be edited and loaded again while the simulator runs.
+ */
+
 void file_put_in_memory(file_t *file, reg base)
 {
     file->base = base;
 
-    for (int i = 0; i < file->image_size; i++) {
-        mem_storeb(base, i, file->image[i]);
+    byte *host = memory_range(base, file->image_size);
+    if (!host) {
+        for (int i = 0; i < file->image_size; i++) {
+            mem_storeb(base, i, file->image[i]);
+        }
+        return;
     }
+
+    mem_will_write(base, file->image_size);
+    memcpy(host, file->image, file->image_size);
+    icache_invalidate_range(base, file->image_size);
 }
 
-void file_free(file_t *file)
+/*
+ * Hashes for telling whether files have changed (FNV-1a).  Start h at
+ * HASH_INIT.
+ */
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
 {
-    if (file->fp) {
-        fclose(file->fp);
-        file->fp = NULL;
+    const byte *p = data;
+
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
     }
 
+    return h;
+}
+
+uint64_t file_hash(file_t *file)
+{
+    return hash_bytes(HASH_INIT, file->image, file->image_size);
+}
+
+void file_free(file_t *file)
+{
     if (file->image) {
-        free(file->image);
+        munmap(file->image, file->image_size);
     }
 
     free(file);
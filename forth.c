@@ -85,9 +85,7 @@ static void forth_err(F f, int err_num)
 {
     fprintf(stderr, "%s\n", f->err_str);
     f->err_num = err_num;
-    fprintf(stderr, "ERROR: About to longjmp(%d) to infinity\n", err_num);
-    exit(-1);
-//    longjmp(f->forth_jmpbuf, err_num);
+    longjmp(f->forth_jmpbuf, err_num);
 }
 
 static void forth_assert(F f, int condition, int err, const char *fmt, ...)
@@ -380,6 +378,80 @@ FWORD(type)
 }
 
 
+/*
+ **********************************************************
+ *
+ * Simulator words
+ *
+ **********************************************************
+ **/
+
+/*
+ * With -checkpoint, undo and redo go back and forward through
+ * checkpoints; goto and #instrs need them.
+ */
+
+FWORD(undo)     /* n -- */
+{
+    cell n = POP;
+
+    if (!checkpoint_interval) undo(n);
+    else checkpoint_goto(n < checkpoint_count ? checkpoint_count - n : 0);
+}
+
+FWORD(redo)     /* n -- */
+{
+    cell n = POP;
+
+    if (!checkpoint_interval) redo(n);
+    else checkpoint_goto(checkpoint_count + n);
+}
+
+FWORD(goto)     /* n -- */
+{
+    forth_assert(f, checkpoint_interval != 0, FERR_NO_CHECKPOINTS, "goto needs -checkpoint");
+    checkpoint_goto(POP);
+}
+
+FWORD2(instrs, "#instrs")  { PUSH(checkpoint_count); }   /* -- n */
+
+/*
+ * baseline remembers the machine; reset puts it back (see baseline.c).
+ */
+
+FWORD(baseline)     /* -- */
+{
+    forth_assert(f, !checkpoint_interval, FERR_NO_BASELINE, "baseline can't be used with -checkpoint");
+    baseline_take();
+}
+
+FWORD(reset)        /* -- */
+{
+    forth_assert(f, baseline_active, FERR_NO_BASELINE, "reset needs a baseline");
+    baseline_reset();
+}
+
+/*
+ * snapshot save <file>
+ *
+ * Saves the machine as soon as the line is read; -restore <file> starts
+ * from it.
+ */
+
+FWORD_IMM(snapshot)
+{
+    forth_assert(f, forth_token(f) && strcmp(f->token_string, "save") == 0,
+                 FERR_INVALID_TOKEN, "usage: snapshot save <file>");
+    forth_assert(f, forth_token(f), FERR_NEED_MORE_INPUT, "");
+
+    // The name may be longer than a token
+    char *filename = strndup(&f->input[f->token_start], f->token_end - f->token_start);
+    ASSERT(filename);
+    snapshot_save(filename);
+    free(filename);
+}
+
+
 /*
  **********************************************************
  *
@@ -443,6 +515,84 @@ FWORD_DO(get)  {  PUSH(*forth_get_var_address(f)); }
 FWORD_DO(seti) {       *forth_get_array_address(f) = POP; }
 FWORD_DO(geti) {  PUSH(*forth_get_array_address(f)); }
 
+/*
+ **********************************************************
+ *
+ * Guest Words
+ *
+ **********************************************************
+ **/
+
+/*
+ * The guest's words, found by name (see forth_find_word() in dtc.c).
+ *
+ * ' <name>         ( -- cfa )  The code field of the guest's word
+ * break <name>     Stop at the prompt when the word is entered
+ * unbreak <name>
+ * continue         Run without tracing until a breakpoint
+ */
+
+static reg forth_breakpoints[MAX_BREAK_POINTS];
+static int num_forth_breakpoints;
+
+static reg forth_guest_word(F f)
+{
+    forth_assert(f, forth_token(f), FERR_NEED_MORE_INPUT, "");
+
+    reg cfa = forth_find_word(f->token_string);
+    forth_assert(f, cfa != 0, FERR_NO_GUEST_WORD, "%s isn't a word in the image", f->token_string);
+
+    return cfa;
+}
+
+FWORD_IMM2(tick, "'")
+{
+    reg cfa = forth_guest_word(f);
+
+    forth_compile_word(f, &fword_do_lit_header);
+    forth_compile_cons(f, cfa);
+}
+
+FWORD_IMM(break)
+{
+    reg cfa = forth_guest_word(f);
+
+    for (int i = 0; i < num_forth_breakpoints; i++) {
+        if (forth_breakpoints[i] == cfa) return;
+    }
+    forth_assert(f, num_forth_breakpoints < MAX_BREAK_POINTS, FERR_TOO_MANY_BREAKPOINTS,
+                 "There can only be %d breakpoints", MAX_BREAK_POINTS);
+    forth_breakpoints[num_forth_breakpoints++] = cfa;
+}
+
+FWORD_IMM(unbreak)
+{
+    reg cfa = forth_guest_word(f);
+
+    for (int i = 0; i < num_forth_breakpoints; i++) {
+        if (forth_breakpoints[i] == cfa) {
+            forth_breakpoints[i] = forth_breakpoints[--num_forth_breakpoints];
+            return;
+        }
+    }
+}
+
+FWORD(continue)  { sim_continue = 1; }
+
+/*
+ * Is there a breakpoint at pc?
+ */
+
+int forth_breakpoint(reg pc)
+{
+    for (int i = 0; i < num_forth_breakpoints; i++) {
+        if (forth_breakpoints[i] == pc) return 1;
+    }
+
+    return 0;
+}
+
+
 /**********************************************************
  *
  * Branch Words
@@ -893,6 +1043,18 @@ void forth_process_input(F f, char *input, int len)
     f->code_offset = 0;
     f->colon_header = NULL;
 
+    if (setjmp(f->forth_jmpbuf)) {
+        /*
+         * forth_err() has reported the error; drop what was on the stacks
+         * and the rest of the input.
+         */
+        f->sp = STACK_SIZE;
+        f->rp = RSTACK_SIZE;
+        f->lp = LOOP_STACK_SIZE;
+        f->state_sp = STATE_STACK_SIZE;
+        return;
+    }
+
     while (forth_token(f)) {
         forth_header_t *w = forth_lookup_token(f);
         if (!w) w = &fword_do_number_header;
@@ -944,3 +1106,18 @@ F forth_new(void)
 
     return f;
 }
+
+/*
+ * forth_debugger()
+ *
+ * Run a line typed at the simulator's interactive prompt.
+ */
+
+void forth_debugger(char *line)
+{
+    static F f;
+
+    if (!f) f = forth_new();
+
+    forth_process_input(f, line, strlen(line));
+}
@@ -182,6 +182,10 @@ enum {
     FERR_EMBEDDED_COLON,
     FERR_SEMICOLON_WOUT_COLON,
     FERR_MISMATCHED_CONTROL,
+    FERR_NO_CHECKPOINTS,
+    FERR_NO_BASELINE,
+    FERR_NO_GUEST_WORD,
+    FERR_TOO_MANY_BREAKPOINTS,
 };
 
 F forth_new(void);
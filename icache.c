@@ -0,0 +1,286 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+#include "sim.h"
+#include "arm.h"
+
+/*
+ * icache.c
+ *
+ * The predecoded instruction cache.  execute_one() used to fetch, decode
+ * and pick apart every instruction every time it ran.  Now the first
+ * execution of a guest word decodes it into an icache_entry_t and later
+ * executions go straight to the entry's handler.
+ *
+ * The cache is a flat table of page pointers indexed by guest address.
+ * Pages are allocated the first time code on them is executed, so data
+ * pages never cost anything.  Any store into guest memory clears the
+ * entry for the stored word; the next execution there decodes it again.
+ *
+ * When muForth's machinery is fused (see dtc.c), the entry at the start
+ * of each recognised routine runs the whole routine.
+ */
+
+#define ICACHE_NUM_PAGES	(1 << (32 - ICACHE_PAGE_SHIFT))
+#define ICACHE_PAGE_ENTRIES	(ICACHE_PAGE_SIZE / sizeof(reg))
+
+typedef struct icache_page_s {
+    icache_entry_t entry[ICACHE_PAGE_ENTRIES];
+} icache_page_t;
+
+static icache_page_t *icache_pages[ICACHE_NUM_PAGES];
+
+int icache_disable;
+
+#define PAGE(addr)		((addr) >> ICACHE_PAGE_SHIFT)
+#define INDEX(addr)		(((addr) & ICACHE_PAGE_MASK) >> 2)
+
+void icache_predecode(icache_entry_t *e, reg pc, reg instr)
+{
+    arm_instr_t op = arm_decode_instr(instr);
+
+    bzero(e, sizeof(*e));
+    e->instr = instr;
+    e->op = op;
+    e->cond = IBITS(28, 4);
+    e->rm = IBITS(0, 4);
+    e->rs = IBITS(8, 4);
+    e->rd = IBITS(12, 4);
+    e->rn = IBITS(16, 4);
+    e->shift_type = IBITS(5, 2);
+    e->shift = IBITS(7, 5);
+    e->setconds = IBIT(20);
+    e->pre_post = IBIT(24);
+    e->up_down = IBIT(23);
+    e->write_back = IBIT(21);
+
+    switch (op) {
+    case ARM_INSTR_B:
+        e->imm = decode_dest_addr(pc, IBITS(0, 24), 24, 0);
+        e->link = IBIT(24);
+        break;
+
+    case ARM_INSTR_LDR:
+    case ARM_INSTR_STR:
+        e->imm_form = !IBIT(25);
+        e->byte_xfer = IBIT(22);
+        if (e->up_down) e->imm =  IBITS(0, 12);
+        else            e->imm = -IBITS(0, 12);
+        break;
+
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_RSB:
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_CMP:
+    case ARM_INSTR_CMN:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        if (op == ARM_INSTR_TST ||
+            op == ARM_INSTR_TEQ ||
+            op == ARM_INSTR_CMP ||
+            op == ARM_INSTR_CMN) {
+            e->setconds = 1;
+        }
+
+        e->imm_form = IBIT(25);
+        e->reg_shift = IBIT(4);
+        if (e->imm_form) {
+            reg imm8bit = IBITS(0, 8);
+            reg imm_rot = IBITS(8, 4);
+
+            e->imm = imm8bit << (imm_rot << 1);
+            if (imm_rot > 0) {
+                e->imm_carry = (imm8bit << ((imm_rot << 1) -1)) >> 31;
+            } else {
+                e->imm_carry = imm8bit & 1;  // XXX: Is this right?
+            }
+        }
+        break;
+
+    case ARM_INSTR_MUL:
+    case ARM_INSTR_MULL:
+        /*
+         * The multiplies keep Rd in bits 16-19 and Rn in bits 12-15.
+         */
+        e->rd = IBITS(16, 4);
+        e->rn = IBITS(12, 4);
+        break;
+
+    default:
+        break;
+    }
+
+    e->handler = execute_handler(e);
+}
+
+static icache_entry_t *icache_fill(reg pc)
+{
+    reg instr = mem_load(pc, 0);
+
+    if (instr == BAD_MEMVAL) {
+        return NULL;
+    }
+
+    icache_page_t **pp = &icache_pages[PAGE(pc)];
+    if (!*pp) {
+        *pp = calloc(1, sizeof(icache_page_t));
+        ASSERT(*pp);
+    }
+
+    icache_entry_t *e = &(*pp)->entry[INDEX(pc)];
+    byte covered = e->covered;
+    icache_predecode(e, pc, instr);
+    e->covered = covered;
+
+    /*
+     * A fused sequence never crosses a page, so a store into any of its
+     * words finds it through icache_drop_blocks().
+     */
+    if (forth_fuse && forth_fuse_machinery(e, pc)) {
+        for (int i = 1; i < e->span; i++) {
+            (*pp)->entry[INDEX(pc) + i].covered = 1;
+        }
+    }
+
+    return e;
+}
+
+icache_entry_t *icache_lookup(reg pc)
+{
+    icache_page_t *p = icache_pages[PAGE(pc)];
+
+    if (p && !(pc & 3)) {
+        icache_entry_t *e = &p->entry[INDEX(pc)];
+        if (e->handler) return e;
+    }
+
+    /*
+     * Unaligned PCs fall through to mem_load() so that they are reported
+     * the same way they always have been.
+     */
+
+    return icache_fill(pc);
+}
+
+/*
+ * icache_ends_block()
+ *
+ * Does the instruction write the PC (or do anything else that code
+ * following it in a straight line can't be run past)?  Used to find the
+ * end of JIT blocks and superinstructions.
+ */
+
+int icache_ends_block(icache_entry_t *e)
+{
+    reg instr = e->instr;
+
+    switch (e->op) {
+    case ARM_INSTR_LDR:
+        if (e->rd == PC) return 1;
+        /* Fall through */
+    case ARM_INSTR_STR:
+        return e->rn == PC && (e->write_back || !e->pre_post);
+
+    case ARM_INSTR_LDM:
+        if (IBIT(PC)) return 1;
+        /* Fall through */
+    case ARM_INSTR_STM:
+        return e->write_back && e->rn == PC;
+
+    case ARM_INSTR_MUL:
+        return e->rd == PC;
+
+    case ARM_INSTR_MULL:
+        return e->rd == PC || e->rn == PC;
+
+    case ARM_INSTR_B:
+        return 0;
+
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_RSB:
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        return e->rd == PC;
+
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_CMP:
+    case ARM_INSTR_CMN:
+        return 0;
+
+    default:
+        return 1;   // Illegal or unimplemented
+    }
+}
+
+/*
+ * Translated blocks and fused sequences never cross a page, so when code
+ * inside one is stored over, dropping every block and every fused entry
+ * on that page is enough.
+ */
+
+static void icache_drop_blocks(icache_page_t *p)
+{
+    for (int i = 0; i < ICACHE_PAGE_ENTRIES; i++) {
+        icache_entry_t *e = &p->entry[i];
+        if (e->span > 1) {
+            e->handler = NULL;
+        }
+        e->block = NULL;
+        e->covered = 0;
+        e->heat = 0;
+    }
+    jit_flushed = 1;
+}
+
+void icache_drop_all_blocks(void)
+{
+    for (int i = 0; i < ICACHE_NUM_PAGES; i++) {
+        if (icache_pages[i]) {
+            icache_drop_blocks(icache_pages[i]);
+        }
+    }
+}
+
+void icache_invalidate(reg addr)
+{
+    icache_page_t *p = icache_pages[PAGE(addr)];
+
+    if (p) {
+        icache_entry_t *e = &p->entry[INDEX(addr)];
+        e->handler = NULL;
+        if (e->covered) {
+            icache_drop_blocks(p);
+        }
+    }
+}
+
+void icache_invalidate_range(reg addr, reg size)
+{
+    reg end = addr + size;
+
+    for (addr &= ~3; addr < end; addr += 4) {
+        icache_invalidate(addr);
+    }
+}
@@ -0,0 +1,183 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * input.c
+ *
+ * Scripted input for the readline callback.
+ *
+ * Input can be queued ahead of time: a file (mapped, not read) or a
+ * buffer.  io_readline() takes its lines from the queue, in order, before
+ * it goes to stdin.  A line is found with memchr() and copied straight
+ * into the guest's buffer, just as fgets() would leave it: at most len - 1
+ * bytes, the newline included, then a NUL.  A line doesn't run on from
+ * one piece of queued input into the next.
+ *
+ * -input file queues a script for the whole run.  A driver such as
+ * batch.c queues each run's input itself, and ends it with input_end() so
+ * the run sees the end of its input there rather than going on to stdin.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct input_s {
+    struct input_s *next;
+    const char *data;
+    size_t len, pos;
+    void *map;              // To unmap, or NULL
+    char *copy;             // To free, or NULL
+} input_t;
+
+static input_t *input_head, *input_tail;
+static int input_ended;
+
+static void input_add(input_t *in)
+{
+    in->next = NULL;
+    if (input_tail) {
+        input_tail->next = in;
+    } else {
+        input_head = in;
+    }
+    input_tail = in;
+}
+
+static void input_drop(void)
+{
+    input_t *in = input_head;
+
+    input_head = in->next;
+    if (!input_head) input_tail = NULL;
+
+    if (in->map) munmap(in->map, in->len);
+    free(in->copy);
+    free(in);
+}
+
+/*
+ * input_queue_file()
+ *
+ * Queue the contents of the file name.  Returns 0 if it can't be read.
+ */
+
+int input_queue_file(char *name)
+{
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    input_t *in = calloc(1, sizeof(input_t));
+    ASSERT(in);
+
+    in->len = st.st_size;
+    if (in->len) {
+        in->map = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->map == MAP_FAILED) {
+            close(fd);
+            free(in);
+            return 0;
+        }
+        madvise(in->map, in->len, MADV_SEQUENTIAL);
+        in->data = in->map;
+    }
+    close(fd);
+
+    input_add(in);
+    return 1;
+}
+
+/*
+ * input_queue_buffer()
+ *
+ * Queue len bytes of buf.  With copy, buf is copied; otherwise it must
+ * stay as it is until its lines have all been read.
+ */
+
+void input_queue_buffer(const char *buf, size_t len, int copy)
+{
+    input_t *in = calloc(1, sizeof(input_t));
+    ASSERT(in);
+
+    if (copy && len) {
+        in->copy = malloc(len);
+        ASSERT(in->copy);
+        memcpy(in->copy, buf, len);
+        buf = in->copy;
+    }
+    in->data = buf;
+    in->len = len;
+
+    input_add(in);
+}
+
+/*
+ * The input ends after what's queued now; stdin isn't read.
+ */
+
+void input_end(void)
+{
+    input_ended = 1;
+}
+
+/*
+ * Drop whatever is still queued, and read stdin again after the queue.
+ */
+
+void input_discard(void)
+{
+    while (input_head) {
+        input_drop();
+    }
+    input_ended = 0;
+}
+
+/*
+ * input_line()
+ *
+ * Copy the next queued line into s, which holds len bytes, as fgets()
+ * would.  Returns the line's length, or -1 if nothing is queued and the
+ * line should come from stdin.
+ */
+
+long input_line(char *s, reg len)
+{
+    while (input_head && input_head->pos == input_head->len) {
+        input_drop();
+    }
+
+    if (!input_head) {
+        if (!input_ended) return -1;
+        if (len) *s = '\0';
+        return 0;
+    }
+
+    if (!len) return 0;
+
+    input_t *in = input_head;
+    const char *p = in->data + in->pos;
+    size_t n = in->len - in->pos;
+
+    if (n > len - 1) n = len - 1;
+
+    const char *nl = memchr(p, '\n', n);
+    if (nl) n = nl + 1 - p;
+
+    memcpy(s, p, n);
+    s[n] = '\0';
+    in->pos += n;
+
+    return n;
+}
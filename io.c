@@ -6,6 +6,24 @@
  */
 
 #include "sim.h"
+#include "arm.h"
+#include <unistd.h>
+
+/*
+ * Files read by getfile are put in memory one after another from here.
+ */
+
+static reg getfiles = GB(2) + MB(16);
+
+reg io_getfiles(void)
+{
+    return getfiles;
+}
+
+void io_set_getfiles(reg addr)
+{
+    getfiles = addr;
+}
 
 reg io_readfile(reg filename, reg len)
 {
@@ -19,24 +37,86 @@ reg io_readfile(reg filename, reg len)
 
     file_t *f = file_load(s);
 
+    if (snapshot_booting) snapshot_boot_file(s, f);
+    free(s);
     if (!f) return 0;
 
-    static reg getfiles = GB(2) + MB(16);
-
     reg fp = getfiles;
+    undo_record_range(getfiles, 4 + f->image_size);
     mem_store(getfiles, 0, f->image_size);
     getfiles += 4;
 
     file_put_in_memory(f, getfiles);
     getfiles += (f->image_size + 63) & ~63;
+    file_free(f);
 
     return fp;
 }
 
+/*
+ * Guest output
+ *
+ * What the guest types goes to io_out, stdout unless -output names a
+ * file, with one fwrite() for each type that's all in memory.  When
+ * io_out isn't a terminal it gets a large buffer, so heavy output costs
+ * a write() per IO_OUT_BUFFER bytes.  The buffer is flushed whenever the
+ * guest asks for a line from stdin, so a prompt is out before its answer
+ * is read.
+ * The simulator's own messages to stdout go through the same stream, so
+ * they stay in order with the guest's.
+ */
+
+#define IO_OUT_BUFFER	(256 * 1024)
+
+static FILE *io_out;
+
+void io_init(char *output)
+{
+    io_out = stdout;
+    if (output && !(io_out = fopen(output, "w"))) {
+        error("Couldn't create %s", output);
+    }
+
+    if (!isatty(fileno(io_out))) {
+        setvbuf(io_out, NULL, _IOFBF, IO_OUT_BUFFER);
+    }
+}
+
+/*
+ * Send guest output to fp from now on (see batch_open()).
+ */
+
+void io_set_output(FILE *fp)
+{
+    fflush(io_out);
+    io_out = fp;
+}
+
+void io_flush(void)
+{
+    fflush(io_out);
+}
+
+/*
+ * Output the guest typed in an earlier run (see snapshot_boot_restore()).
+ */
+
+void io_replay(const char *buf, size_t len)
+{
+    fwrite(buf, 1, len, io_out);
+}
+
 void io_write(reg str, reg len)
 {
     char *s;
 
+    if (len && mem_range_is_valid(str, len)) {
+        s = memory_range(str, len);
+        fwrite(s, 1, len, io_out);
+        if (snapshot_booting) snapshot_boot_output(s, len);
+        return;
+    }
+
     while (len-- > 0) {
         s = memory_range(str++, 1);
         if (!s) {
@@ -48,7 +128,8 @@ void io_write(reg str, reg len)
             return;
         }
 
-        printf("%c", *s);
+        fputc(*s, io_out);
+        if (snapshot_booting) snapshot_boot_output(s, 1);
     }
 }
 
@@ -65,7 +146,16 @@ reg io_readline(reg buffer, reg len)
         return 0;
     }
 
-    fgets(s, len, stdin);
+    undo_record_range(buffer, len);
+    mem_will_write(buffer, len);
+
+    long n = input_line(s, len);
+    if (n < 0) {
+        io_flush();
+        if (!fgets(s, len, stdin)) *s = '\0';     // End of input
+        n = strlen(s);
+    }
+    icache_invalidate_range(buffer, len);
 
-    return strlen(s);
+    return n;
 }
@@ -0,0 +1,577 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * jit.c
+ *
+ * A basic block translator from ARM to x86-64.
+ *
+ * Execution starts out in the threaded engine.  Every time the dispatch
+ * loop arrives at a block start it bumps the heat count in that word's
+ * icache entry; once a start gets hot the block is translated and from
+ * then on the loop calls the host code instead.
+ *
+ * The host code keeps no guest state in host registers.  It works on
+ * r[] directly (rbx points at it) so the machine state is always exact
+ * at every call out of the block.  Translated code also only ever sees
+ * packed flags: lazy flags (see arm.h) are packed before a block runs
+ * and after every handler it calls.  That keeps the translator small:
+ *
+ *  - B/BL, MOV/MVN/AND/EOR/ORR/BIC/ADD/SUB/RSB and the compares, with an
+ *    immediate, a register or a register shifted by a non-zero constant,
+ *    are translated inline, including their flags;
+ *  - LDR/STR/LDRB/STRB with an immediate offset compute the address
+ *    inline and call mem_load()/mem_store();
+ *  - any other instruction the threaded engine supports is translated
+ *    into a call to its icache handler.
+ *
+ * A block ends after a branch, before any instruction that writes the PC
+ * (including loads into the PC, which is how muForth's NEXT works), at a
+ * page boundary or after JIT_MAX_BLOCK instructions.  Instructions that
+ * write the PC, the callback addresses 1-5, fused muForth machinery
+ * (see dtc.c) and anything the decoder doesn't know are always left to
+ * the interpreter.
+ *
+ * Each word in a translated block is marked in its icache entry.  A store
+ * to a marked word drops every block on that page (see icache.c) and
+ * sets jit_flushed, which the running block checks after each store so
+ * that it never runs stale code.  Host code memory is only reclaimed, all
+ * at once, from the dispatch loop.
+ *
+ * On hosts other than x86-64 nothing is ever translated and jit_run() is
+ * the threaded engine.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <sys/mman.h>
+
+#define JIT_THRESHOLD		16
+#define JIT_MAX_BLOCK		64
+#define JIT_CODE_SIZE		MB(16)
+#define JIT_MAX_BLOCK_CODE	(JIT_MAX_BLOCK * 128 + 64)
+#define JIT_NEVER			0xFFFF
+
+int jit_flushed;
+
+typedef void (*jit_block_t)(void);
+
+#if defined(__x86_64__)
+
+static byte *jit_code;
+static byte *jit_code_ptr;
+static byte *jit_code_end;
+
+static byte *p;     // Emit pointer
+
+/*
+ * x86-64 encodings
+ */
+
+#define EAX		0
+#define ECX		1
+#define EDX		2
+#define EBX		3
+#define ESI		6
+#define EDI		7
+
+#define REG_DISP(n)		((n) * 4)
+#define FLAGS_DISP		REG_DISP(FLAGS)
+#define PC_DISP			REG_DISP(PC)
+#define LR_DISP			REG_DISP(LR)
+
+static void emit8(byte b)		{ *p++ = b; }
+static void emit32(reg v)		{ memcpy(p, &v, 4); p += 4; }
+static void emit64(uint64_t v)	{ memcpy(p, &v, 8); p += 8; }
+
+#define EMIT(...)	do {									\
+        const byte _b[] = { __VA_ARGS__ };						\
+        memcpy(p, _b, sizeof(_b)); p += sizeof(_b);			\
+    } while (0)
+
+static void emit_load(int x86reg, int disp)       // mov x86reg, [rbx+disp]
+{
+    EMIT(0x8B, 0x43 | (x86reg << 3), disp);
+}
+
+static void emit_store(int x86reg, int disp)      // mov [rbx+disp], x86reg
+{
+    EMIT(0x89, 0x43 | (x86reg << 3), disp);
+}
+
+static void emit_store_imm(int disp, reg v)       // mov dword [rbx+disp], v
+{
+    EMIT(0xC7, 0x43, disp);
+    emit32(v);
+}
+
+static void emit_mov_imm(int x86reg, reg v)       // mov x86reg, v
+{
+    emit8(0xB8 + x86reg);
+    emit32(v);
+}
+
+static void emit_call(void *fn)                   // movabs rax, fn; call rax
+{
+    EMIT(0x48, 0xB8);
+    emit64((uintptr_t) fn);
+    EMIT(0xFF, 0xD0);
+}
+
+static byte *emit_jcc(byte cc)                    // jcc rel32, patched later
+{
+    EMIT(0x0F, cc);
+    emit32(0);
+    return p;
+}
+
+static void patch_jcc(byte *after, byte *target)
+{
+    reg rel = target - after;
+    memcpy(after - 4, &rel, 4);
+}
+
+#define JZ		0x84
+#define JNZ		0x85
+
+/*
+ * Guest register reads.  Reading the PC gives the address of the
+ * instruction plus 8, as the interpreter does.
+ */
+
+static void emit_get_reg(int x86reg, int rn, reg pc, reg pc_bias)
+{
+    if (rn == PC) {
+        emit_mov_imm(x86reg, pc + pc_bias);
+    } else {
+        emit_load(x86reg, REG_DISP(rn));
+    }
+}
+
+static void emit_exit(reg next_pc)
+{
+    emit_store_imm(PC_DISP, next_pc);
+    EMIT(0x41, 0x5D,        // pop r13
+         0x41, 0x5C,        // pop r12
+         0x5B,              // pop rbx
+         0xC3);             // ret
+}
+
+/*
+ * Condition checks branch to 'skip' when the condition fails.  The single
+ * flag tests are inline; everything else goes through
+ * execute_check_conds() so that it is evaluated exactly as the
+ * interpreter evaluates it.
+ */
+
+static byte *emit_cond(reg cond)
+{
+    static const byte flag[8] = { Z, Z, C, C, N, N, V, V };
+
+    if (cond < 8) {
+        EMIT(0xF7, 0x43, FLAGS_DISP);           // test dword [rbx+FLAGS], flag
+        emit32(flag[cond]);
+        return emit_jcc((cond & 1) ? JNZ : JZ);
+    }
+
+    emit_mov_imm(EDI, cond);
+    emit_call(execute_check_conds);
+    EMIT(0x85, 0xC0);                           // test eax, eax
+    return emit_jcc(JZ);
+}
+
+/*
+ * Pack the host flags into r[FLAGS].  N and Z come from the host flags
+ * (which must still be live); r9d holds V and r10d holds C.
+ */
+
+static void emit_pack_flags(void)
+{
+    EMIT(0x41, 0x0F, 0x98, 0xC3,    // sets r11b
+         0x41, 0x0F, 0x94, 0xC0,    // setz r8b
+         0x45, 0x0F, 0xB6, 0xC0,    // movzx r8d, r8b
+         0x45, 0x0F, 0xB6, 0xDB,    // movzx r11d, r11b
+         0x41, 0xD1, 0xE1,          // shl r9d, 1
+         0x41, 0xC1, 0xE2, 0x02,    // shl r10d, 2
+         0x41, 0xC1, 0xE3, 0x03,    // shl r11d, 3
+         0x45, 0x09, 0xC8,          // or r8d, r9d
+         0x45, 0x09, 0xD0,          // or r8d, r10d
+         0x45, 0x09, 0xD8,          // or r8d, r11d
+         0x44, 0x89, 0x43, FLAGS_DISP);  // mov [rbx+FLAGS], r8d
+}
+
+static void emit_old_c(void)                // r10d = C
+{
+    EMIT(0x44, 0x8B, 0x53, FLAGS_DISP,      // mov r10d, [rbx+FLAGS]
+         0x41, 0xC1, 0xEA, C_SHIFT,         // shr r10d, C_SHIFT
+         0x41, 0x83, 0xE2, 0x01);           // and r10d, 1
+}
+
+static void emit_old_v(void)                // r9d = V
+{
+    EMIT(0x44, 0x8B, 0x4B, FLAGS_DISP,      // mov r9d, [rbx+FLAGS]
+         0x41, 0xC1, 0xE9, V_SHIFT,         // shr r9d, V_SHIFT
+         0x41, 0x83, 0xE1, 0x01);           // and r9d, 1
+}
+
+static int is_logical(arm_instr_t op)
+{
+    switch (op) {
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int is_test(arm_instr_t op)
+{
+    return op == ARM_INSTR_TST || op == ARM_INSTR_TEQ ||
+           op == ARM_INSTR_CMP || op == ARM_INSTR_CMN;
+}
+
+/*
+ * Can this data-processing instruction be translated inline?
+ */
+
+static int jit_dp_inline(icache_entry_t *e)
+{
+    switch (e->op) {
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+        return 0;
+    default:
+        break;
+    }
+
+    if (e->imm_form) return 1;
+    if (e->reg_shift) return 0;
+    if (e->shift == 0 && e->shift_type != 0) return 0;  // LSR/ASR #32, RRX
+
+    return 1;
+}
+
+static void jit_dp(icache_entry_t *e, reg pc)
+{
+    arm_instr_t op = e->op;
+    int flags = e->setconds;        // rd == PC is never translated
+    int logical = is_logical(op);
+
+    /*
+     * ecx = operand 2; for a logical op with flags r10d = shifter carry.
+     */
+    if (e->imm_form) {
+        emit_mov_imm(ECX, e->imm);
+        if (flags && logical) {
+            EMIT(0x41, 0xBA);               // mov r10d, imm_carry
+            emit32(e->imm_carry);
+        }
+    } else {
+        emit_get_reg(ECX, e->rm, pc, 8);
+        if (e->shift) {
+            static const byte shift_op[4] = { 0xE1, 0xE9, 0xF9, 0xC9 };  // shl shr sar ror
+            EMIT(0xC1, shift_op[e->shift_type], e->shift);
+            if (flags && logical) {
+                EMIT(0x41, 0x0F, 0x92, 0xC2,        // setc r10b
+                     0x45, 0x0F, 0xB6, 0xD2);       // movzx r10d, r10b
+            }
+        } else if (flags && logical) {
+            emit_old_c();
+        }
+    }
+
+    if (flags && logical) {
+        emit_old_v();
+    }
+
+    if (op != ARM_INSTR_MOV && op != ARM_INSTR_MVN) {
+        emit_get_reg(EAX, e->rn, pc, 8);
+    }
+
+    switch (op) {
+    case ARM_INSTR_AND:
+    case ARM_INSTR_TST: EMIT(0x21, 0xC8); break;                 // and eax, ecx
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_TEQ: EMIT(0x31, 0xC8); break;                 // xor eax, ecx
+    case ARM_INSTR_ORR: EMIT(0x09, 0xC8); break;                 // or eax, ecx
+    case ARM_INSTR_BIC: EMIT(0xF7, 0xD1, 0x21, 0xC8); break;     // not ecx; and eax, ecx
+    case ARM_INSTR_MOV: EMIT(0x89, 0xC8); break;                 // mov eax, ecx
+    case ARM_INSTR_MVN: EMIT(0x89, 0xC8, 0xF7, 0xD0); break;     // mov eax, ecx; not eax
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_CMN: EMIT(0x01, 0xC8); break;                 // add eax, ecx
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_CMP: EMIT(0x29, 0xC8); break;                 // sub eax, ecx
+    case ARM_INSTR_RSB: EMIT(0x29, 0xC1, 0x89, 0xC8); break;     // sub ecx, eax; mov eax, ecx
+    default: break;
+    }
+
+    if (flags) {
+        if (logical) {
+            EMIT(0x85, 0xC0);                           // test eax, eax
+        } else {
+            EMIT(0x41, 0x0F, 0x90, 0xC1,                // seto r9b
+                 0x45, 0x0F, 0xB6, 0xC9);               // movzx r9d, r9b
+            if (op == ARM_INSTR_ADD || op == ARM_INSTR_CMN) {
+                EMIT(0x41, 0x0F, 0x92, 0xC2);           // setc r10b
+            } else {
+                EMIT(0x41, 0x0F, 0x93, 0xC2);           // setnc r10b
+            }
+            EMIT(0x45, 0x0F, 0xB6, 0xD2,                // movzx r10d, r10b
+                 0x85, 0xC0);                           // test eax, eax
+        }
+        emit_pack_flags();
+    }
+
+    if (!is_test(op)) {
+        emit_store(EAX, REG_DISP(e->rd));
+    }
+}
+
+static int jit_store_word(reg addr, reg val)
+{
+    mem_store(addr, 0, val);
+    return jit_flushed;
+}
+
+static int jit_store_byte(reg addr, reg val)
+{
+    mem_storeb(addr, 0, val);
+    return jit_flushed;
+}
+
+static int jit_exec(icache_entry_t *e)
+{
+    e->handler(e);
+    arm_flags_sync();
+    return jit_flushed;
+}
+
+/*
+ * Immediate offset LDR/STR.  r12d keeps the address across the call for
+ * the write back; r13d keeps the flushed flag returned by a store.
+ */
+
+static void jit_xfer(icache_entry_t *e, reg pc)
+{
+    int load = e->op == ARM_INSTR_LDR;
+
+    emit_get_reg(EAX, e->rn, pc, 8);
+    if (e->pre_post && e->imm) {
+        EMIT(0x05);                             // add eax, imm
+        emit32(e->imm);
+    }
+    EMIT(0x41, 0x89, 0xC4,                      // mov r12d, eax
+         0x89, 0xC7,                            // mov edi, eax
+         0x31, 0xF6);                           // xor esi, esi
+
+    if (load) {
+        emit_call(e->byte_xfer ? (void *) mem_loadb : (void *) mem_load);
+        if (e->byte_xfer) {
+            EMIT(0x0F, 0xB6, 0xC0);             // movzx eax, al
+        }
+        emit_store(EAX, REG_DISP(e->rd));
+    } else {
+        emit_get_reg(ESI, e->rd, pc, 4);
+        emit_call(e->byte_xfer ? (void *) jit_store_byte : (void *) jit_store_word);
+        EMIT(0x41, 0x89, 0xC5);                 // mov r13d, eax
+    }
+
+    if (e->write_back || !e->pre_post) {
+        EMIT(0x44, 0x89, 0xE0);                 // mov eax, r12d
+        if (!e->pre_post && e->imm) {
+            EMIT(0x05);                         // add eax, imm
+            emit32(e->imm);
+        }
+        emit_store(EAX, REG_DISP(e->rn));
+    }
+
+    if (!load) {
+        EMIT(0x45, 0x85, 0xED);                 // test r13d, r13d
+        byte *cont = emit_jcc(JZ);
+        emit_exit(pc + 4);
+        patch_jcc(cont, p);
+    }
+}
+
+static void jit_call_handler(icache_entry_t *e, reg pc)
+{
+    EMIT(0x48, 0xBF);                           // movabs rdi, e
+    emit64((uintptr_t) e);
+    emit_call(jit_exec);
+    EMIT(0x85, 0xC0);                           // test eax, eax
+    byte *cont = emit_jcc(JZ);
+    emit_exit(pc + 4);
+    patch_jcc(cont, p);
+}
+
+static jit_block_t jit_translate(reg start)
+{
+    if (jit_code_end - jit_code_ptr < JIT_MAX_BLOCK_CODE) {
+        icache_drop_all_blocks();
+        jit_code_ptr = jit_code;
+    }
+
+    byte *code = p = jit_code_ptr;
+    reg pc = start;
+    int n = 0;
+
+    EMIT(0x53,                  // push rbx
+         0x41, 0x54,            // push r12
+         0x41, 0x55);           // push r13
+    EMIT(0x48, 0xBB);           // movabs rbx, r
+    emit64((uintptr_t) r);
+
+    for (;;) {
+        if (n > 0 && ((pc & ICACHE_PAGE_MASK) == 0 || n == JIT_MAX_BLOCK)) {
+            break;
+        }
+
+        icache_entry_t *e = icache_lookup(pc);
+        if (!e || e->span > 1 || icache_ends_block(e)) {
+            break;
+        }
+
+        byte *skip = NULL;
+        if (e->cond != 0xE) {
+            skip = emit_cond(e->cond);
+        }
+
+        n++;
+        if (e->op == ARM_INSTR_B) {
+            if (e->link) {
+                emit_store_imm(LR_DISP, pc + 4);
+            }
+            emit_exit(e->imm);
+            if (skip) patch_jcc(skip, p);
+            pc += 4;
+            break;
+        }
+
+        if (e->op >= ARM_INSTR_AND && e->op <= ARM_INSTR_MVN && jit_dp_inline(e)) {
+            jit_dp(e, pc);
+        } else if ((e->op == ARM_INSTR_LDR || e->op == ARM_INSTR_STR) && e->imm_form) {
+            emit_store_imm(PC_DISP, pc + 4);
+            jit_xfer(e, pc);
+        } else {
+            emit_store_imm(PC_DISP, pc + 4);
+            jit_call_handler(e, pc);
+        }
+
+        if (skip) patch_jcc(skip, p);
+        pc += 4;
+    }
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    /*
+     * Fall through to the next instruction.  A taken branch has already
+     * exited; this is where an untaken one ends up.
+     */
+    emit_exit(pc);
+
+    for (reg a = start; a < pc; a += 4) {
+        icache_lookup(a)->covered = 1;
+    }
+
+    jit_code_ptr = p;
+
+    return (jit_block_t) code;
+}
+
+static int jit_init(void)
+{
+    if (jit_code) return 1;
+
+    jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (jit_code == MAP_FAILED) {
+        warn("Couldn't allocate memory for the JIT; using the threaded engine");
+        jit_code = NULL;
+        return 0;
+    }
+
+    jit_code_ptr = jit_code;
+    jit_code_end = jit_code + JIT_CODE_SIZE;
+
+    return 1;
+}
+
+#else
+
+static jit_block_t jit_translate(reg start) { return NULL; }
+static int jit_init(void) { return 0; }
+
+#endif
+
+/*
+ * jit_run()
+ *
+ * The JIT's dispatch loop.  Like threaded_run() it is only used when
+ * nothing needs to look at the machine between instructions; in
+ * addition, the undo log must be off, since translated code doesn't
+ * record undo entries.  Returns 0 if an instruction faults.
+ */
+
+int jit_run(void)
+{
+    int translating = jit_init();
+
+    while (!sim_done) {
+        reg pc = r[PC];
+
+        if (pc > 0 && pc < 6) {
+            execute_callbacks(pc);
+            continue;
+        }
+
+        icache_entry_t *e = icache_lookup(pc);
+        if (!e) {
+            return 0;
+        }
+
+        if (e->block) {
+            arm_flags_sync();
+            jit_flushed = 0;
+            ((jit_block_t) e->block)();
+            continue;
+        }
+
+        if (translating && e->heat != JIT_NEVER && ++e->heat >= JIT_THRESHOLD) {
+            jit_block_t block = jit_translate(pc);
+            if (block) {
+                /*
+                 * Translation may have recycled the code buffer, which
+                 * clears every entry, so look this one up again.
+                 */
+                e = icache_lookup(pc);
+                e->block = block;
+                continue;
+            }
+            e->heat = JIT_NEVER;
+        }
+
+        r[PC] = pc + 4;
+
+        if (e->cond == 0xE || execute_check_conds(e->cond)) {
+            if (!e->handler(e)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
@@ -7,18 +7,139 @@
 
 #include "sim.h"
 #include "arm.h"
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Guest memory is a list of regions, each one host allocation, added with
+ * memory_more().  Every access used to walk that list.  Now the regions
+ * are also entered into a flat page table: one host pointer per guest
+ * page, so that looking up an address is a shift, a load and an add.
+ *
+ * A page that is only partly covered by a region (which only happens
+ * when a region isn't page aligned) has no page table entry, and
+ * accesses to it fall back to walking the region list.  So does any
+ * access that spans two pages.
+ */
 
 typedef struct memory_s {
     byte *memory;
     reg base, end, size;
 } memory_t;
 
-#define MAX_NUM_RANGES		5
 static int num_mem_ranges;
-static memory_t mem_range[MAX_NUM_RANGES];
+static memory_t *mem_range;
+
+static byte *mem_page[MEM_NUM_PAGES];
 
 #define WITHIN(a, s, e) (((a) >= (s)) && ((a) < (e)))
 
+static void mem_map_pages(memory_t *m)
+{
+    reg first = (m->base + MEM_PAGE_MASK) & ~MEM_PAGE_MASK;
+
+    for (reg page = first; page - m->base + MEM_PAGE_SIZE <= m->size; page += MEM_PAGE_SIZE) {
+        mem_page[MEM_PAGE(page)] = m->memory + (page - m->base);
+        if (page + MEM_PAGE_SIZE == 0) break;   // Top of the address space
+    }
+}
+
+/*
+ * The reserved address space backend (-mem-reserve)
+ *
+ * All 4GB of guest address space is reserved as one PROT_NONE host
+ * mapping and each region is made accessible at its natural offset in
+ * it.  mem_load() and friends then turn a guest address into a host
+ * address with one add and no bounds check.
+ *
+ * An access outside every region faults.  The SIGSEGV handler makes the
+ * faulting page accessible and sets mem_faulted; the access completes
+ * against that page, and the accessor, seeing mem_faulted, warns, throws
+ * the access away and protects the page again.  The result is the same
+ * warning and the same BAD_MEMVAL as the region walk gives.
+ *
+ * Regions are committed in whole host pages, so the few bytes that share
+ * a page with an unaligned region's ends become accessible too.
+ */
+
+static byte *mem_reserved;
+static size_t mem_host_page;
+static byte * volatile mem_fault_page;
+static volatile int mem_faulted;
+
+#define MEM_RESERVE_SIZE	((size_t) 1 << 32)
+
+static void mem_segv(int sig, siginfo_t *info, void *context)
+{
+    byte *addr = info->si_addr;
+
+    if (!mem_faulted && addr >= mem_reserved && addr < mem_reserved + MEM_RESERVE_SIZE) {
+        byte *page = (byte *) ((uintptr_t) addr & ~(mem_host_page - 1));
+        if (mprotect(page, mem_host_page, PROT_READ | PROT_WRITE) == 0) {
+            mem_fault_page = page;
+            mem_faulted = 1;
+            return;
+        }
+    }
+
+    /*
+     * Not ours: let it fault again and kill us.
+     */
+    signal(SIGSEGV, SIG_DFL);
+}
+
+void mem_reserve(void)
+{
+    if (sizeof(void *) < 8) {
+        warn("No room for a 4GB reservation on this host; not using -mem-reserve");
+        return;
+    }
+
+    byte *p = mmap(NULL, MEM_RESERVE_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        warn("Couldn't reserve 4GB of address space; not using -mem-reserve");
+        return;
+    }
+
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_sigaction = mem_segv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+#if defined(MACOSX)
+    sigaction(SIGBUS, &sa, NULL);   // Protection faults are SIGBUS here
+#endif
+
+    mem_host_page = sysconf(_SC_PAGESIZE);
+    mem_reserved = p;
+}
+
+static void mem_commit(reg base, reg size)
+{
+    uintptr_t start = (uintptr_t) (mem_reserved + base) & ~(mem_host_page - 1);
+    uintptr_t end = (uintptr_t) (mem_reserved + base) + size;
+
+    if (mprotect((void *) start, end - start, PROT_READ | PROT_WRITE) != 0) {
+        error("Couldn't commit memory region %8.8x - %8.8x", base, base + size);
+    }
+}
+
+/*
+ * mem_fault_done()
+ *
+ * Called by an accessor that finds mem_faulted set after its access.
+ */
+
+static void mem_fault_done(reg arm_addr)
+{
+    mprotect(mem_fault_page, mem_host_page, PROT_NONE);
+    mem_faulted = 0;
+    warn("simulator address %p outside of memory range", arm_addr);
+}
+
 void memory_more(reg base, reg size)
 {
     for (int i = 0; i < num_mem_ranges; i++) {
@@ -32,84 +153,244 @@ void memory_more(reg base, reg size)
         }
     }
 
-    if (num_mem_ranges >= MAX_NUM_RANGES) {
-        error("Out of memory ranges");
-    }
+    mem_range = realloc(mem_range, (num_mem_ranges + 1) * sizeof(memory_t));
+    assert(mem_range);
 
     memory_t *m = &mem_range[num_mem_ranges++];
 
-    m->memory = malloc(size);
-    assert(m->memory);
+    if (mem_reserved) {
+        mem_commit(base, size);
+        m->memory = mem_reserved + base;
+    } else {
+        /*
+         * Anonymous memory is page aligned, which snapshot_restore() needs
+         * to map pages over it, and zero without being touched.
+         */
+        m->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (m->memory == MAP_FAILED) {
+            error("Couldn't allocate memory region %8.8x - %8.8x", base, base + size);
+        }
+    }
 
     m->base = base;
     m->end  = base + size;
     m->size = size;
 
-    bzero(m->memory, size);
+    mem_map_pages(m);
 }
 
-int mem_addr_is_valid(reg arm_addr)
+/*
+ * mem_region()
+ *
+ * For walking the regions: the host memory of region i, with its guest
+ * base and size, or NULL when there are no more.
+ */
+
+byte *mem_region(int i, reg *base, reg *size)
 {
-    for (int i = 0; i < num_mem_ranges; i++) {
-        memory_t *p = &mem_range[i];
-        if (WITHIN(arm_addr, p->base, p->end)) return 1;
+    if (i >= num_mem_ranges) {
+        return NULL;
     }
-    return 0;
+
+    *base = mem_range[i].base;
+    *size = mem_range[i].size;
+
+    return mem_range[i].memory;
 }
 
 static int mem_range_index(reg base, reg size)
 {
-    reg end = base + size;
     for (int i = 0; i < num_mem_ranges; i++) {
         memory_t *p = &mem_range[i];
         if (WITHIN(base, p->base, p->end) &&
-            WITHIN(end,  p->base, p->end))
+            size <= p->end - base)
             return i;
     }
     return -1;
 }
 
+/*
+ * mem_host_addr()
+ *
+ * The host address of [arm_addr, arm_addr + size), or NULL if that isn't
+ * all inside one region.
+ */
+
+static inline void *mem_host_addr(reg arm_addr, reg size)
+{
+    byte *page = mem_page[MEM_PAGE(arm_addr)];
+
+    if (page && size <= MEM_PAGE_SIZE - (arm_addr & MEM_PAGE_MASK)) {
+        return page + (arm_addr & MEM_PAGE_MASK);
+    }
+
+    int i = mem_range_index(arm_addr, size);
+    if (i < 0) {
+        return NULL;
+    }
+
+    return mem_range[i].memory + (arm_addr - mem_range[i].base);
+}
+
+int mem_addr_is_valid(reg arm_addr)
+{
+    return mem_host_addr(arm_addr, 1) != NULL;
+}
+
 int mem_range_is_valid(reg base, reg size)
 {
-    if (mem_range_index(base, size) == -1)
-        return 0;
-    return 1;
+    return mem_host_addr(base, size) != NULL;
 }
 
 void *memory_range(reg base, reg size)
 {
-    int i = mem_range_index(base, size);
-    if (i < 0) {
+    void *addr = mem_host_addr(base, size);
+
+    if (!addr) {
         warn("simulator address %p outside of memory range", base);
-        return NULL;
     }
 
-    return mem_range->memory + (base - mem_range[i].base);
+    return addr;
 }
 
-static reg *mem_addr(reg arm_addr, reg arm_size)
+static inline reg *mem_addr(reg arm_addr, reg arm_size)
 {
     if (arm_addr & (arm_size -1)) {
             warn("Unaligned referenced: %p of size %d", arm_addr, arm_size);
             return 0;
     }
 
-    reg *addr = memory_range(arm_addr, arm_size);
+    return memory_range(arm_addr, arm_size);
+}
 
-    return addr;
+/*
+ * Write tracking
+ *
+ * With mem_track_writes set, the first store into each page after
+ * mem_clear_written() calls checkpoint_page_written(), or with a baseline
+ * baseline_page_written(), for the page before the store lands.
+ */
+
+int mem_track_writes;
+
+static byte mem_written[MEM_NUM_PAGES];
+static reg *mem_written_pages;
+static int mem_num_written, mem_max_written;
+
+static void mem_first_write(reg page)
+{
+    if (mem_num_written == mem_max_written) {
+        mem_max_written = mem_max_written ? mem_max_written * 2 : 256;
+        mem_written_pages = realloc(mem_written_pages, mem_max_written * sizeof(reg));
+        ASSERT(mem_written_pages);
+    }
+    mem_written_pages[mem_num_written++] = page;
+    mem_written[page] = 1;
+
+    if (baseline_active) baseline_page_written(page << MEM_PAGE_SHIFT);
+    else                 checkpoint_page_written(page << MEM_PAGE_SHIFT);
+}
+
+/*
+ * Only stores that land are tracked.  With -mem-reserve, a store outside
+ * memory only shows itself by faulting, after this, so the address is
+ * checked here.  Once a page has been written the check isn't reached.
+ */
+#define MEM_WILL_STORE(arm_addr) \
+    do { \
+        if (mem_track_writes && !mem_written[MEM_PAGE(arm_addr)] && \
+            mem_addr_is_valid(arm_addr)) \
+            mem_first_write(MEM_PAGE(arm_addr)); \
+    } while (0)
+
+/*
+ * mem_will_write()
+ *
+ * For code that writes guest memory through memory_range().
+ */
+
+void mem_will_write(reg arm_addr, reg size)
+{
+    if (!mem_track_writes || !size) return;
+
+    reg last = MEM_PAGE(arm_addr + size - 1);
+    for (reg page = MEM_PAGE(arm_addr); ; page++) {
+        if (!mem_written[page]) mem_first_write(page);
+        if (page == last) break;
+    }
+}
+
+void mem_clear_written(void)
+{
+    for (int i = 0; i < mem_num_written; i++) {
+        mem_written[mem_written_pages[i]] = 0;
+    }
+    mem_num_written = 0;
+}
+
+/*
+ * mem_copy_page()
+ *
+ * Copy a guest page to data or, with restore set, data to the guest page.
+ * Bytes of the page outside of memory are skipped.
+ */
+
+void mem_copy_page(reg page, byte *data, int restore)
+{
+    if (mem_range_is_valid(page, MEM_PAGE_SIZE)) {
+        byte *host = memory_range(page, MEM_PAGE_SIZE);
+        if (restore) memcpy(host, data, MEM_PAGE_SIZE);
+        else         memcpy(data, host, MEM_PAGE_SIZE);
+        return;
+    }
+
+    for (reg i = 0; i < MEM_PAGE_SIZE; i++) {
+        if (mem_range_is_valid(page + i, 1)) {
+            byte *host = memory_range(page + i, 1);
+            if (restore) *host = data[i];
+            else         data[i] = *host;
+        }
+    }
 }
 
+#define MEM_RESERVED(type, arm_addr)	((volatile type *) (mem_reserved + (arm_addr)))
+
 void mem_store(reg arm_addr, reg arm_offset, reg val)
 {
+    if (mem_reserved && !((arm_addr + arm_offset) & 3)) {
+        arm_addr += arm_offset;
+        MEM_WILL_STORE(arm_addr);
+        *MEM_RESERVED(reg, arm_addr) = val;
+        if (mem_faulted) {
+            mem_fault_done(arm_addr);
+        } else {
+            icache_invalidate(arm_addr);
+        }
+        return;
+    }
+
     reg *addr = mem_addr(arm_addr + arm_offset, sizeof(reg));
 
     if (addr) {
+        MEM_WILL_STORE(arm_addr + arm_offset);
         *addr = val;
+        icache_invalidate(arm_addr + arm_offset);
     }
 }
 
 reg mem_load(reg arm_addr, reg arm_offset)
 {
+    if (mem_reserved && !((arm_addr + arm_offset) & 3)) {
+        arm_addr += arm_offset;
+        reg val = *MEM_RESERVED(reg, arm_addr);
+        if (mem_faulted) {
+            mem_fault_done(arm_addr);
+            return BAD_MEMVAL;
+        }
+        return val;
+    }
+
     reg *addr = mem_addr(arm_addr + arm_offset, sizeof(reg));
 
     if (addr) {
@@ -121,15 +402,39 @@ reg mem_load(reg arm_addr, reg arm_offset)
 
 void mem_storeb(reg arm_addr, reg arm_offset, byte val)
 {
+    if (mem_reserved) {
+        arm_addr += arm_offset;
+        MEM_WILL_STORE(arm_addr);
+        *MEM_RESERVED(byte, arm_addr) = val;
+        if (mem_faulted) {
+            mem_fault_done(arm_addr);
+        } else {
+            icache_invalidate(arm_addr);
+        }
+        return;
+    }
+
     byte *addr = (byte *) mem_addr(arm_addr + arm_offset, 1);
 
     if (addr) {
+        MEM_WILL_STORE(arm_addr + arm_offset);
         *addr = val;
+        icache_invalidate(arm_addr + arm_offset);
     }
 }
 
 byte mem_loadb(reg arm_addr, reg arm_offset)
 {
+    if (mem_reserved) {
+        arm_addr += arm_offset;
+        byte val = *MEM_RESERVED(byte, arm_addr);
+        if (mem_faulted) {
+            mem_fault_done(arm_addr);
+            return (byte) BAD_MEMVAL;
+        }
+        return val;
+    }
+
     byte *addr = (byte *) mem_addr(arm_addr + arm_offset, 1);
 
     if (addr) {
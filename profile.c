@@ -0,0 +1,463 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * profile.c
+ *
+ * The execution profiler (-profile).
+ *
+ * profile_run() takes the place of threaded_run() when profiling: the
+ * same dispatch loop, with the same handlers, that also counts each
+ * instruction it runs.  Nothing is counted anywhere else, so a run
+ * without -profile costs exactly what it did.  Fusion, superinstructions
+ * and the JIT run many instructions as one, so they are off while
+ * profiling and every instruction is counted at its own address.
+ *
+ * Counts are kept per guest PC, in pages of counters laid out like the
+ * icache's, and per instruction class (arm_instr_t).  Instructions whose
+ * condition failed, taken branches (anything that left the PC somewhere
+ * other than the next instruction), loads, stores and callbacks are
+ * counted too.  profile_report() prints the totals, the wall time spent
+ * running and the rate, the instruction mix and the -profile-top
+ * addresses run most, disassembled.
+ *
+ * With -profile-words, instructions are also charged to Forth words.  A
+ * colon definition is entered where docolon (or dodoes) runs ENTER, with
+ * LR just past the code field that branched there; the NEXT that took it
+ * to that code field marks where its instructions start.  It has returned
+ * once RP rises above where ENTER left it.  A shadow stack of the colon
+ * definitions being run follows RP that way, so words that leave by
+ * dropping return addresses, or reset RP, are handled too.  Each
+ * instruction counts towards the self count of the innermost colon
+ * definition (the code words it runs included) and once towards the
+ * inclusive count of every distinct word on the stack.  Code words,
+ * entered by NEXT at a code field that isn't a branch, get their own call
+ * and instruction counts.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <time.h>
+
+#define PROFILE_NUM_PAGES	(1 << (32 - ICACHE_PAGE_SHIFT))
+#define PROFILE_PAGE_ENTRIES	(ICACHE_PAGE_SIZE / sizeof(reg))
+
+#define PAGE(addr)		((addr) >> ICACHE_PAGE_SHIFT)
+#define INDEX(addr)		(((addr) & ICACHE_PAGE_MASK) >> 2)
+
+#define NUM_CALLBACKS		6
+#define NUM_CLASSES		(ARM_INSTR_LDM + 1)
+
+int profile_enable;
+int profile_top = 20;
+
+static uint64_t *profile_pages[PROFILE_NUM_PAGES];
+
+static uint64_t profile_instrs;
+static uint64_t profile_cond_failed;
+static uint64_t profile_taken;
+static uint64_t profile_loads, profile_stores;
+static uint64_t profile_class[NUM_CLASSES];
+static uint64_t profile_callbacks[NUM_CALLBACKS];
+static double profile_seconds;
+
+static char *profile_class_name[NUM_CLASSES] = {
+    "illegal", "b", "swi",
+    "and", "eor", "sub", "rsb", "add", "adc", "sbc", "rsc",
+    "tst", "teq", "cmp", "cmn", "orr", "mov", "bic", "mvn",
+    "mul", "mull",
+    "str", "ldr",
+    "ldrsh", "ldrsb", "ldrh", "strh",
+    "stm", "ldm",
+};
+
+static char *profile_callback_name[NUM_CALLBACKS] = {
+    "", "exit", "type", "readline", "getfile", "sync",
+};
+
+/*
+ * Forth words, by code field address
+ */
+
+int profile_words;
+
+typedef struct profile_word_s {
+    reg cfa;
+    int colon;
+    int active;             // Frames on the shadow stack
+    uint64_t calls, self, inclusive;
+} profile_word_t;
+
+typedef struct profile_frame_s {
+    profile_word_t *word;
+    reg rp;
+    uint64_t start;         // profile_instrs when entered
+} profile_frame_t;
+
+static profile_word_t **profile_word_table;
+static int num_profile_words, max_profile_words;
+
+static profile_frame_t *profile_frames;
+static int num_profile_frames, max_profile_frames;
+
+static profile_word_t *profile_code;       // The code word NEXT entered last
+static reg profile_entry;                   // The branch NEXT entered last
+static uint64_t profile_entry_start;
+static uint64_t profile_outside;            // Run outside any colon definition
+
+#define PROFILE_HASH(cfa, size)	(((cfa) >> 2) * 2654435761u & ((size) - 1))
+
+static void profile_word_insert(profile_word_t *w)
+{
+    reg h = PROFILE_HASH(w->cfa, max_profile_words);
+
+    while (profile_word_table[h]) h = (h + 1) & (max_profile_words - 1);
+    profile_word_table[h] = w;
+}
+
+static profile_word_t *profile_word(reg cfa, int colon)
+{
+    if (2 * (num_profile_words + 1) > max_profile_words) {
+        profile_word_t **old = profile_word_table;
+        int old_max = max_profile_words;
+
+        max_profile_words = max_profile_words ? max_profile_words * 2 : 1024;
+        profile_word_table = calloc(max_profile_words, sizeof(profile_word_t *));
+        ASSERT(profile_word_table);
+
+        for (int i = 0; i < old_max; i++) {
+            if (old[i]) profile_word_insert(old[i]);
+        }
+        free(old);
+    }
+
+    reg h = PROFILE_HASH(cfa, max_profile_words);
+    while (profile_word_table[h]) {
+        profile_word_t *w = profile_word_table[h];
+
+        if (w->cfa == cfa) {
+            w->colon |= colon;
+            return w;
+        }
+        h = (h + 1) & (max_profile_words - 1);
+    }
+
+    profile_word_t *w = calloc(1, sizeof(profile_word_t));
+    ASSERT(w);
+    w->cfa = cfa;
+    w->colon = colon;
+    profile_word_table[h] = w;
+    num_profile_words++;
+
+    return w;
+}
+
+static void profile_pop(void)
+{
+    profile_frame_t *f = &profile_frames[--num_profile_frames];
+
+    if (--f->word->active == 0) {
+        f->word->inclusive += profile_instrs - f->start;
+    }
+}
+
+/*
+ * profile_word_step()
+ *
+ * Charge the instruction at e, which has just run, and follow any change
+ * of word it made.
+ */
+
+static void profile_word_step(icache_entry_t *e)
+{
+    if (num_profile_frames) {
+        profile_frames[num_profile_frames - 1].word->self++;
+    } else {
+        profile_outside++;
+    }
+    if (profile_code) profile_code->self++;
+
+    while (num_profile_frames && r[RP] > profile_frames[num_profile_frames - 1].rp) {
+        profile_pop();
+    }
+
+    if (e->instr == NEXT) {
+        reg cfa = r[PC];
+        reg instr = mem_range_is_valid(cfa, 4) ? mem_load(cfa, 0) : 0;
+
+        profile_code = NULL;
+        if (arm_decode_instr(instr) != ARM_INSTR_B) {
+            profile_code = profile_word(cfa, 0);
+            profile_code->calls++;
+        } else {
+            profile_entry = cfa;
+            profile_entry_start = profile_instrs;
+        }
+    } else if (e->instr == ENTER) {
+        profile_word_t *w = profile_word(r[LR] - 4, 1);
+        uint64_t start = profile_instrs;
+
+        /*
+         * The branch at the code field and docolon up to here were
+         * charged to the caller; they're the new word's.
+         */
+        if (w->cfa == profile_entry) {
+            uint64_t n = profile_instrs - profile_entry_start;
+
+            if (num_profile_frames) {
+                profile_frames[num_profile_frames - 1].word->self -= n;
+            } else {
+                profile_outside -= n;
+            }
+            w->self += n;
+            start = profile_entry_start;
+        }
+        profile_entry = 0;
+
+        if (num_profile_frames == max_profile_frames) {
+            max_profile_frames = max_profile_frames ? max_profile_frames * 2 : 256;
+            profile_frames = realloc(profile_frames, max_profile_frames * sizeof(profile_frame_t));
+            ASSERT(profile_frames);
+        }
+        profile_frames[num_profile_frames++] = (profile_frame_t) {w, r[RP], start};
+        w->calls++;
+        w->active++;
+        profile_code = NULL;
+    }
+}
+
+static uint64_t *profile_counter(reg pc)
+{
+    uint64_t **p = &profile_pages[PAGE(pc)];
+
+    if (!*p) {
+        *p = calloc(PROFILE_PAGE_ENTRIES, sizeof(uint64_t));
+        ASSERT(*p);
+    }
+
+    return &(*p)[INDEX(pc)];
+}
+
+static double profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * profile_run()
+ *
+ * threaded_run(), counting.
+ */
+
+int profile_run(void)
+{
+    double start = profile_now();
+    int ok = 1;
+
+    while (!sim_done) {
+        reg pc = arm_get_reg(PC);
+
+        if (pc > 0 && pc < 6) {
+            profile_callbacks[pc]++;
+            execute_callbacks(pc);
+            continue;
+        }
+
+        icache_entry_t *e = icache_lookup(pc);
+        if (!e) {
+            ok = 0;
+            break;
+        }
+
+        profile_instrs++;
+        (*profile_counter(pc))++;
+        profile_class[e->op]++;
+
+        if (!undo_disable) undo_record_reg(PC);
+        r[PC] = pc + 4;
+
+        if (e->cond == 0xE || execute_check_conds(e->cond)) {
+            switch (e->op) {
+            case ARM_INSTR_LDR: case ARM_INSTR_LDSH: case ARM_INSTR_LDSB:
+            case ARM_INSTR_LDUH: case ARM_INSTR_LDM:
+                profile_loads++;
+                break;
+            case ARM_INSTR_STR: case ARM_INSTR_STH: case ARM_INSTR_STM:
+                profile_stores++;
+                break;
+            default:
+                break;
+            }
+
+            ok = e->handler(e);
+            if (ok && r[PC] != pc + 4) profile_taken++;
+        } else {
+            profile_cond_failed++;
+        }
+
+        if (profile_words) profile_word_step(e);
+
+        undo_finish_instr();
+        if (!ok) break;
+    }
+
+    profile_seconds += profile_now() - start;
+
+    return ok;
+}
+
+typedef struct profile_hot_s {
+    reg pc;
+    uint64_t count;
+} profile_hot_t;
+
+static int profile_hot_cmp(const void *a, const void *b)
+{
+    const profile_hot_t *x = a, *y = b;
+
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static double profile_percent(uint64_t n)
+{
+    return profile_instrs ? 100.0 * n / profile_instrs : 0;
+}
+
+static int profile_word_cmp(const void *a, const void *b)
+{
+    const profile_word_t *x = *(profile_word_t **) a, *y = *(profile_word_t **) b;
+
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    if (x->inclusive != y->inclusive) return x->inclusive < y->inclusive ? 1 : -1;
+    return x->cfa < y->cfa ? -1 : x->cfa > y->cfa;
+}
+
+static void profile_words_report(void)
+{
+    /*
+     * Whatever is still running when the program ends is charged with
+     * what it has run so far.
+     */
+    while (num_profile_frames) {
+        profile_pop();
+    }
+
+    profile_word_t **words = calloc(num_profile_words + 1, sizeof(profile_word_t *));
+    int n = 0;
+
+    ASSERT(words);
+    for (int i = 0; i < max_profile_words; i++) {
+        profile_word_t *w = profile_word_table[i];
+
+        if (!w) continue;
+        if (!w->colon) w->inclusive = w->self;
+        words[n++] = w;
+    }
+    qsort(words, n, sizeof(profile_word_t *), profile_word_cmp);
+
+    fprintf(stderr, "Forth words: %d seen, %llu instructions outside any colon definition\n",
+            n, (unsigned long long) profile_outside);
+    fprintf(stderr, "%14s  %14s  %6s  %14s  %6s  %s\n",
+            "calls", "self", "", "inclusive", "", "word (: colon definition)");
+    for (int k = 0; k < n && k < profile_top; k++) {
+        profile_word_t *w = words[k];
+        char *name = forth_lookup_word_name(w->cfa);
+
+        fprintf(stderr, "%14llu  %14llu  %5.1f%%  %14llu  %5.1f%%  ",
+                (unsigned long long) w->calls, (unsigned long long) w->self,
+                profile_percent(w->self), (unsigned long long) w->inclusive,
+                profile_percent(w->inclusive));
+        if (w->colon) fprintf(stderr, ": ");
+        if (name) {
+            fprintf(stderr, "%s\n", name);
+        } else {
+            fprintf(stderr, "%8.8x\n", w->cfa);
+        }
+        free(name);
+    }
+
+    free(words);
+}
+
+void profile_report(void)
+{
+    fprintf(stderr, "Profile: %llu instructions in %.3fs",
+            (unsigned long long) profile_instrs, profile_seconds);
+    if (profile_seconds > 0) {
+        fprintf(stderr, ", %.1f MIPS", profile_instrs / profile_seconds / 1e6);
+    }
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "%14llu  %5.1f%%  condition failed\n",
+            (unsigned long long) profile_cond_failed, profile_percent(profile_cond_failed));
+    fprintf(stderr, "%14llu  %5.1f%%  branches taken\n",
+            (unsigned long long) profile_taken, profile_percent(profile_taken));
+    fprintf(stderr, "%14llu  %5.1f%%  loads\n",
+            (unsigned long long) profile_loads, profile_percent(profile_loads));
+    fprintf(stderr, "%14llu  %5.1f%%  stores\n",
+            (unsigned long long) profile_stores, profile_percent(profile_stores));
+    for (int i = 1; i < NUM_CALLBACKS; i++) {
+        fprintf(stderr, "%14llu          %s callbacks\n",
+                (unsigned long long) profile_callbacks[i], profile_callback_name[i]);
+    }
+
+    fprintf(stderr, "Instruction mix:\n");
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        if (!profile_class[i]) continue;
+        fprintf(stderr, "%14llu  %5.1f%%  %s\n", (unsigned long long) profile_class[i],
+                profile_percent(profile_class[i]), profile_class_name[i]);
+    }
+
+    if (profile_words) profile_words_report();
+
+    /*
+     * The hottest addresses, kept sorted by insertion as the pages are
+     * walked.
+     */
+    if (profile_top <= 0) return;
+
+    profile_hot_t *hot = calloc(profile_top + 1, sizeof(profile_hot_t));
+    int num_hot = 0;
+
+    ASSERT(hot);
+
+    for (reg page = 0; page < PROFILE_NUM_PAGES; page++) {
+        uint64_t *counts = profile_pages[page];
+
+        if (!counts) continue;
+
+        for (reg i = 0; i < PROFILE_PAGE_ENTRIES; i++) {
+            profile_hot_t h = {(page << ICACHE_PAGE_SHIFT) | (i << 2), counts[i]};
+            int k;
+
+            if (!h.count) continue;
+            if (num_hot == profile_top && profile_hot_cmp(&h, &hot[num_hot - 1]) >= 0) continue;
+
+            for (k = num_hot; k > 0 && profile_hot_cmp(&h, &hot[k - 1]) < 0; k--) {
+                hot[k] = hot[k - 1];
+            }
+            hot[k] = h;
+            if (num_hot < profile_top) num_hot++;
+        }
+    }
+
+    fprintf(stderr, "Hot addresses:\n");
+    for (int k = 0; k < num_hot; k++) {
+        char buff[80];
+        reg instr = mem_load(hot[k].pc, 0);
+
+        disassemble(hot[k].pc, instr, buff, sizeof(buff));
+        fprintf(stderr, "%14llu  %5.1f%%  %8.8x: %8.8x  %s\n", (unsigned long long) hot[k].count,
+                profile_percent(hot[k].count), hot[k].pc, instr, buff);
+    }
+
+    free(hot);
+}
@@ -0,0 +1,171 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * reloc.c
+ *
+ * Relocating the kernel in bulk.
+ *
+ * The image is the kernel's cells followed by a relocation bitmap, a bit
+ * per cell; base is added to each cell whose bit is set.  reloc_apply()
+ * writes the relocated kernel straight into host memory, a bitmap word
+ * (32 cells) at a time.  With AVX2 or SSE2, each bit of the word is
+ * spread into a lane mask, and the masked base is added to 8 or 4 cells
+ * at once; elsewhere the same is done a cell at a time without branches.
+ * Images of RELOC_THREAD_MIN cells or more are split among threads, a
+ * run of whole bitmap words each.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RELOC_X86
+#include <immintrin.h>
+#endif
+
+#define RELOC_THREAD_MIN	(1 << 20)	// Cells, 4MB
+#define RELOC_MAX_THREADS	8
+
+typedef void reloc_fn_t(reg *dst, const reg *src, const reg *bits, int nwords, reg base);
+
+static void reloc_scalar(reg *dst, const reg *src, const reg *bits, int nwords, reg base)
+{
+    for (int i = 0; i < nwords; i++) {
+        reg b = bits[i];
+        for (int j = 0; j < 32; j++) {
+            dst[j] = src[j] + (-((b >> j) & 1) & base);
+        }
+        dst += 32;
+        src += 32;
+    }
+}
+
+#ifdef RELOC_X86
+
+static void reloc_sse2(reg *dst, const reg *src, const reg *bits, int nwords, reg base)
+{
+    const __m128i vbase = _mm_set1_epi32(base);
+    const __m128i lane = _mm_set_epi32(8, 4, 2, 1);
+
+    for (int i = 0; i < nwords; i++) {
+        reg b = bits[i];
+        for (int g = 0; g < 8; g++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) &src[g * 4]);
+            __m128i sel = _mm_and_si128(_mm_set1_epi32(b >> (g * 4)), lane);
+            __m128i mask = _mm_cmpeq_epi32(sel, lane);
+            v = _mm_add_epi32(v, _mm_and_si128(mask, vbase));
+            _mm_storeu_si128((__m128i *) &dst[g * 4], v);
+        }
+        dst += 32;
+        src += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static void reloc_avx2(reg *dst, const reg *src, const reg *bits, int nwords, reg base)
+{
+    const __m256i vbase = _mm256_set1_epi32(base);
+    const __m256i lane = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+
+    for (int i = 0; i < nwords; i++) {
+        reg b = bits[i];
+        for (int g = 0; g < 4; g++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) &src[g * 8]);
+            __m256i sel = _mm256_and_si256(_mm256_set1_epi32(b >> (g * 8)), lane);
+            __m256i mask = _mm256_cmpeq_epi32(sel, lane);
+            v = _mm256_add_epi32(v, _mm256_and_si256(mask, vbase));
+            _mm256_storeu_si256((__m256i *) &dst[g * 8], v);
+        }
+        dst += 32;
+        src += 32;
+    }
+}
+
+#endif
+
+static reloc_fn_t *reloc_pick(void)
+{
+#ifdef RELOC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return reloc_avx2;
+    if (__builtin_cpu_supports("sse2")) return reloc_sse2;
+#endif
+    return reloc_scalar;
+}
+
+typedef struct reloc_job_s {
+    reloc_fn_t *fn;
+    reg *dst;
+    const reg *src, *bits;
+    int nwords;
+    reg base;
+} reloc_job_t;
+
+static void *reloc_thread(void *arg)
+{
+    reloc_job_t *job = arg;
+
+    job->fn(job->dst, job->src, job->bits, job->nwords, job->base);
+
+    return NULL;
+}
+
+/*
+ * reloc_apply()
+ *
+ * Relocate ncells cells of src into dst.
+ */
+
+void reloc_apply(reg *dst, const reg *src, const reg *bits, reg ncells, reg base)
+{
+    static reloc_fn_t *fn;
+    int nwords = ncells / 32;
+
+    if (!fn) fn = reloc_pick();
+
+    int nthreads = 1;
+    if (ncells >= RELOC_THREAD_MIN) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus < 1 ? 1 : cpus > RELOC_MAX_THREADS ? RELOC_MAX_THREADS : cpus;
+    }
+
+    reloc_job_t jobs[RELOC_MAX_THREADS];
+    pthread_t threads[RELOC_MAX_THREADS];
+    int started = 0, w = 0;
+
+    for (int t = 0; t < nthreads; t++) {
+        int n = nwords / nthreads + (t < nwords % nthreads);
+
+        jobs[t] = (reloc_job_t) {fn, dst + w * 32, src + w * 32, bits + w, n, base};
+        w += n;
+
+        // This thread does the first share itself
+        if (t && pthread_create(&threads[t], NULL, reloc_thread, &jobs[t]) == 0) {
+            started |= 1 << t;
+        } else if (t) {
+            reloc_thread(&jobs[t]);
+        }
+    }
+    reloc_thread(&jobs[0]);
+
+    for (int t = 1; t < nthreads; t++) {
+        if (started & (1 << t)) pthread_join(threads[t], NULL);
+    }
+
+    /*
+     * The cells that don't make up a whole bitmap word
+     */
+    if (ncells % 32) {
+        reg b = bits[nwords];
+        for (reg k = nwords * 32; k < ncells; k++, b >>= 1) {
+            dst[k] = src[k] + (-(b & 1) & base);
+        }
+    }
+}
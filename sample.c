@@ -0,0 +1,294 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * sample.c
+ *
+ * The sampling profiler (-sample file).
+ *
+ * A SIGPROF timer goes off -sample-hz times a second of CPU time.  The
+ * handler only sets SIM_SAMPLE in sim_done, which every engine's dispatch
+ * loop already tests between instructions (or, for the JIT, between
+ * blocks), so the loop returns to sim_run() and a sample is taken there
+ * before the engine is started again.  Nothing is added to the loops, so
+ * sampling costs only the samples.
+ *
+ * A sample is the Forth call stack, outermost first, as forth_backtrace()
+ * sees it: the words holding each return address from rp0 down to RP,
+ * then the word at IP and the word at the PC.  Each address is turned
+ * into the code field of its word with forth_word_at(), through a small
+ * cache, and identical stacks are counted together.  sample_report()
+ * appends them to the file in the collapsed ("folded") format flame graph
+ * tools read:
+ *
+ *	outer;inner;leaf 42
+ *
+ * The file is truncated when the run starts and each report is one
+ * append, so the children of a forked batch add their samples to the
+ * same file.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define SAMPLE_MAX_DEPTH	64
+#define SAMPLE_CACHE_SIZE	4096	// Addresses to words; a power of 2
+#define SAMPLE_SCAN_LIMIT	KB(64)	// How far back a word's header can be
+
+char *sample_file;
+int sample_hz = 997;
+
+static volatile int sample_armed;
+
+typedef struct sample_stack_s {
+    uint64_t hash;
+    uint64_t count;
+    int depth;
+    reg cfa[];
+} sample_stack_t;
+
+static sample_stack_t **sample_table;
+static int num_sample_stacks, max_sample_stacks;
+static uint64_t num_samples;
+
+static struct {
+    reg addr, cfa;
+} sample_cache[SAMPLE_CACHE_SIZE];
+
+static void sample_signal(int sig)
+{
+    if (sample_armed) sim_done |= SIM_SAMPLE;
+}
+
+static void sample_timer(void)
+{
+    struct itimerval it;
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / sample_hz;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+void sample_init(void)
+{
+    int fd = open(sample_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+        error("Couldn't create %s", sample_file);
+    }
+    close(fd);
+
+    if (sample_hz < 1) sample_hz = 1;
+    if (sample_hz > 1000000) sample_hz = 1000000;
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sample_signal;
+    sa.sa_flags = SA_RESTART;     // Don't cut short a read of stdin
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    sample_timer();
+}
+
+/*
+ * In a forked batch job: timers aren't inherited, and the boot's samples
+ * are the parent's.
+ */
+
+void sample_fork(void)
+{
+    if (!sample_file) return;
+
+    for (int i = 0; i < max_sample_stacks; i++) {
+        free(sample_table[i]);
+        sample_table[i] = NULL;
+    }
+    num_sample_stacks = 0;
+    num_samples = 0;
+
+    sample_timer();
+}
+
+/*
+ * The words in memory have changed (see forth_index_reset()).
+ */
+
+void sample_reset(void)
+{
+    memset(sample_cache, 0, sizeof(sample_cache));
+}
+
+static reg sample_word(reg addr)
+{
+    int i = (addr >> 2) & (SAMPLE_CACHE_SIZE - 1);
+
+    if (addr < 6) return 0;     // The callbacks
+    if (sample_cache[i].addr != addr) {
+        sample_cache[i].addr = addr;
+        sample_cache[i].cfa = forth_word_at(addr, SAMPLE_SCAN_LIMIT);
+    }
+
+    return sample_cache[i].cfa;
+}
+
+static void sample_insert(sample_stack_t *s)
+{
+    int h = s->hash & (max_sample_stacks - 1);
+
+    while (sample_table[h]) h = (h + 1) & (max_sample_stacks - 1);
+    sample_table[h] = s;
+}
+
+static void sample_add(reg *cfa, int depth)
+{
+    if (2 * (num_sample_stacks + 1) > max_sample_stacks) {
+        sample_stack_t **old = sample_table;
+        int old_max = max_sample_stacks;
+
+        max_sample_stacks = max_sample_stacks ? max_sample_stacks * 2 : 1024;
+        sample_table = calloc(max_sample_stacks, sizeof(sample_stack_t *));
+        ASSERT(sample_table);
+
+        for (int i = 0; i < old_max; i++) {
+            if (old[i]) sample_insert(old[i]);
+        }
+        free(old);
+    }
+
+    uint64_t hash = hash_bytes(HASH_INIT, cfa, depth * sizeof(reg));
+    int h = hash & (max_sample_stacks - 1);
+
+    for (sample_stack_t *s; (s = sample_table[h]); h = (h + 1) & (max_sample_stacks - 1)) {
+        if (s->hash == hash && s->depth == depth && !memcmp(s->cfa, cfa, depth * sizeof(reg))) {
+            s->count++;
+            return;
+        }
+    }
+
+    sample_stack_t *s = malloc(sizeof(sample_stack_t) + depth * sizeof(reg));
+    ASSERT(s);
+    s->hash = hash;
+    s->count = 1;
+    s->depth = depth;
+    memcpy(s->cfa, cfa, depth * sizeof(reg));
+    sample_table[h] = s;
+    num_sample_stacks++;
+}
+
+static void sample_take(void)
+{
+    reg cfa[SAMPLE_MAX_DEPTH];
+    int depth = 0;
+    reg sp0, rp0, rp = arm_get_reg(RP);
+
+    forth_stacks(&sp0, &rp0);
+
+    /*
+     * The innermost return addresses, if the stack is deeper than a
+     * sample holds.
+     */
+    if (rp <= rp0 && mem_range_is_valid(rp, rp0 - rp)) {
+        reg top = rp0 - 4;
+
+        if ((rp0 - rp) / 4 > SAMPLE_MAX_DEPTH - 2) {
+            top = rp + (SAMPLE_MAX_DEPTH - 3) * 4;
+        }
+        for (reg a = top; a >= rp && a <= top; a -= 4) {
+            reg w = sample_word(mem_load(a, 0));
+            if (w) cfa[depth++] = w;
+        }
+    }
+
+    reg w = sample_word(arm_get_reg(IP));
+    if (w) cfa[depth++] = w;
+    w = sample_word(arm_get_reg(PC));
+    if (w) cfa[depth++] = w;
+
+    num_samples++;
+    if (depth) sample_add(cfa, depth);
+}
+
+/*
+ * sim_run() brackets each run of an engine with these.  sample_stop()
+ * takes the sample that stopped the engine, if one did, and returns 1.
+ */
+
+void sample_start(void)
+{
+    sample_armed = sample_file != NULL;
+}
+
+int sample_stop(void)
+{
+    sample_armed = 0;
+
+    if (!(sim_done & SIM_SAMPLE)) {
+        return 0;
+    }
+    sim_done &= ~SIM_SAMPLE;
+    sample_take();
+
+    return 1;
+}
+
+static void sample_name(FILE *fp, reg cfa)
+{
+    char *name = forth_lookup_word_name(cfa);
+
+    if (!name) {
+        fprintf(fp, "%8.8x", cfa);
+        return;
+    }
+
+    /*
+     * ';' separates the frames.
+     */
+    for (char *p = name; *p; p++) {
+        fputc(*p == ';' ? ',' : *p, fp);
+    }
+    free(name);
+}
+
+void sample_report(void)
+{
+    struct itimerval off = {{0, 0}, {0, 0}};
+    char *text = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&text, &len);
+
+    setitimer(ITIMER_PROF, &off, NULL);
+    ASSERT(fp);
+
+    for (int i = 0; i < max_sample_stacks; i++) {
+        sample_stack_t *s = sample_table[i];
+
+        if (!s) continue;
+        for (int j = 0; j < s->depth; j++) {
+            if (j) fputc(';', fp);
+            sample_name(fp, s->cfa[j]);
+        }
+        fprintf(fp, " %llu\n", (unsigned long long) s->count);
+    }
+    fclose(fp);
+
+    int fd = open(sample_file, O_WRONLY | O_APPEND);
+    if (fd < 0 || write(fd, text, len) != len) {
+        warn("Couldn't write the samples to %s", sample_file);
+    }
+    if (fd >= 0) close(fd);
+    free(text);
+
+    fprintf(stderr, "Samples: %llu, %d stacks, written to %s\n",
+            (unsigned long long) num_samples, num_sample_stacks, sample_file);
+}
@@ -46,7 +46,7 @@ void brkpoint(void)
 const char *prog_name;
 void usage(void)
 {
-    fprintf(stderr, "%s [-dqvu] [-no-undo] [-f filename]\n", prog_name);
+    fprintf(stderr, "%s [-dqvu] [-no-undo] [-undo-budget mb] [-checkpoint n] [-no-icache] [-no-fuse] [-no-super] [-fusion-report] [-mem-reserve] [-engine name] [-restore file] [-boot-cache dir] [-batch list] [-jobs n] [-batch-reset] [-image-cache dir] [-input file] [-output file] [-profile] [-profile-words] [-profile-top n] [-sample file] [-sample-hz n] [-f filename]\n", prog_name);
     fprintf(stderr, "\n");
     fprintf(stderr, "%s will simulate an ARM processor where the input is the\n", prog_name);
     fprintf(stderr, "dictionary of a FORTH environment.  The program can be tailored\n");
@@ -61,7 +61,28 @@ void usage(void)
     fprintf(stderr, "-no-undo     -- Don't enable the undo logic.\n");
     fprintf(stderr, "-v           -- Verbose output; print each instr. and reg values.\n");
     fprintf(stderr, "-u           -- Enable the undo logic.\n");
+    fprintf(stderr, "-undo-budget mb -- Memory for undo history (default 256MB).\n");
+    fprintf(stderr, "-checkpoint n -- Go back by checkpoints taken every n instrs instead of undo.\n");
     fprintf(stderr, "-i           -- Interactive mode.  This also enables: verbose and undo.\n");
+    fprintf(stderr, "-no-icache   -- Decode every instruction each time it executes.\n");
+    fprintf(stderr, "-no-fuse     -- Run muForth's NEXT, docolon, etc. one instruction at a time.\n");
+    fprintf(stderr, "-no-super    -- Don't form superinstructions in the threaded engine.\n");
+    fprintf(stderr, "-fusion-report -- List the superinstructions that ran at exit.\n");
+    fprintf(stderr, "-mem-reserve -- Map guest memory into one reserved 4GB host range.\n");
+    fprintf(stderr, "-engine name -- Execution engine: interp (default), threaded or jit.\n");
+    fprintf(stderr, "-restore file -- Start from a snapshot instead of booting the image.\n");
+    fprintf(stderr, "-boot-cache dir -- Start from the image's first readline, saved in dir.\n");
+    fprintf(stderr, "-batch list  -- Fork a run per input file in list at the first readline.\n");
+    fprintf(stderr, "-jobs n      -- Batch runs at once (default: one per processor).\n");
+    fprintf(stderr, "-batch-reset -- Run the batch in this process, resetting between runs.\n");
+    fprintf(stderr, "-image-cache dir -- Keep the relocated image in dir and map it from there.\n");
+    fprintf(stderr, "-input file  -- Read lines from file before stdin; may be repeated.\n");
+    fprintf(stderr, "-output file -- Write what the program types to file.\n");
+    fprintf(stderr, "-profile     -- Count what runs; report it at the end.\n");
+    fprintf(stderr, "-profile-words -- -profile, and count by Forth word as well.\n");
+    fprintf(stderr, "-profile-top n -- Addresses and words listed by -profile (default: 20).\n");
+    fprintf(stderr, "-sample file -- Sample the Forth call stack; write folded stacks to file.\n");
+    fprintf(stderr, "-sample-hz n -- Samples per second of CPU time (default: 997).\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "The undo logic is a system by which the processor can be backed up some\n");
     fprintf(stderr, "number of instructions.  It is off by default.\n");
@@ -90,13 +111,110 @@ void canonicalise_path(char *path)
         path[len-1] = '\0';
 }
 
+/*
+ * The interactive prompt.  An empty line runs the next instruction.
+ * Anything else is run by the debugger's Forth; e.g., "3 undo".  After
+ * "continue", the prompt doesn't come back until a breakpoint is reached.
+ */
+int sim_continue;
+
+static int sim_prompt(void)
+{
+    char command[256];
+
+    printf("SIM> ");
+    if (!fgets(command, sizeof(command), stdin)) return 1;
+    if (strspn(command, " \t\r\n") == strlen(command)) return 1;
+
+    forth_debugger(command);
+    if (sim_continue) return 1;
+    arm_dump_registers();
+
+    return 0;
+}
+
+/*
+ * Stop continuing at a breakpoint.
+ */
+static void sim_breakpoint(void)
+{
+    reg pc = arm_get_reg(PC);
+
+    if (!forth_breakpoint(pc)) return;
+
+    char *name = forth_lookup_word_name(pc);
+    printf("Breakpoint at %8.8x %s\n", pc, name ? name : "");
+    free(name);
+    sim_continue = 0;
+}
+
+volatile int sim_done;
+
+/*
+ * Run until the program is done or an instruction faults (returning 0),
+ * or a sample is due.
+ */
+static int sim_engine(void)
+{
+    int fast = !icache_disable && quiet && !interactive && !backtrace && !checkpoint_interval;
+
+    if (profile_enable && fast) {
+        return profile_run();
+    } else if (execute_engine == EXECUTE_ENGINE_JIT && fast && undo_disable) {
+        return jit_run();
+    } else if (execute_engine != EXECUTE_ENGINE_INTERP && fast) {
+        return threaded_run();
+    } else {
+        do {
+            if (sim_continue) sim_breakpoint();
+            if (!quiet && !sim_continue) {
+                char buff[256];
+                int sz = sizeof(buff);
+                reg pc = arm_get_reg(PC);
+                if (mem_addr_is_valid(pc)) {
+                    reg instr = mem_load(pc, 0);
+                    disassemble(pc, instr, buff, sz);
+                    printf("%8.8x: %8.8x  %s\n", pc, instr, buff);
+                }
+            }
+            if (interactive && !sim_continue && !sim_prompt()) continue;
+            if (!execute_one()) return 0;
+            if (backtrace) forth_backtrace();
+            if (!quiet && !sim_continue) arm_dump_registers();
+        } while (!sim_done);
+    }
+
+    return 1;
+}
+
+/*
+ * Run until the program is done or an instruction faults (returning 0).
+ */
+static int sim_run(void)
+{
+    int ok;
+
+    do {
+        sample_start();
+        ok = sim_engine();
+    } while (sample_stop() && ok && !sim_done);
+
+    return ok;
+}
 
-int sim_done;
 int main(int argc, char *argv[])
 {
     char *filename = "FORTH.img";
     char *fp_env;
     char **save_argv;
+    int no_fuse = 0;
+    int no_super = 0;
+    int fusion_report = 0;
+    int reserve = 0;
+    char *restore = NULL;
+    char *boot_cache = NULL;
+    char *output = NULL;
+    int ok;
 
     prog_name = argv[0];
 
@@ -136,11 +254,85 @@ int main(int argc, char *argv[])
         } else if (strcmp(*argv, "-u") == 0) {
             undo_disable = 0;
             argv += 1;
+        } else if (strcmp(*argv, "-undo-budget") == 0 && argv[1]) {
+            undo_budget = (size_t) atoi(argv[1]) << 20;
+            argv += 2;
+        } else if (strcmp(*argv, "-checkpoint") == 0 && argv[1]) {
+            checkpoint_interval = strtoull(argv[1], NULL, 0);
+            argv += 2;
         } else if (strcmp(*argv, "-i") == 0) {
             interactive = 1;
             undo_disable = 0;
             quiet = 0;
             argv += 1;
+        } else if (strcmp(*argv, "-no-icache") == 0) {
+            icache_disable = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-no-super") == 0) {
+            no_super = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-fusion-report") == 0) {
+            fusion_report = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-mem-reserve") == 0) {
+            reserve = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-no-fuse") == 0) {
+            no_fuse = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-engine") == 0 && argv[1]) {
+            if (strcmp(argv[1], "interp") == 0) {
+                execute_engine = EXECUTE_ENGINE_INTERP;
+            } else if (strcmp(argv[1], "threaded") == 0) {
+                execute_engine = EXECUTE_ENGINE_THREADED;
+            } else if (strcmp(argv[1], "jit") == 0) {
+                execute_engine = EXECUTE_ENGINE_JIT;
+            } else {
+                usage();
+            }
+            argv += 2;
+        } else if (strcmp(*argv, "-restore") == 0 && argv[1]) {
+            restore = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-boot-cache") == 0 && argv[1]) {
+            boot_cache = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-batch") == 0 && argv[1]) {
+            batch_list = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-jobs") == 0 && argv[1]) {
+            batch_jobs = atoi(argv[1]);
+            argv += 2;
+        } else if (strcmp(*argv, "-batch-reset") == 0) {
+            batch_reset = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-image-cache") == 0 && argv[1]) {
+            image_cache = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-input") == 0 && argv[1]) {
+            if (!input_queue_file(argv[1])) {
+                error("Couldn't read %s", argv[1]);
+            }
+            argv += 2;
+        } else if (strcmp(*argv, "-output") == 0 && argv[1]) {
+            output = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-profile") == 0) {
+            profile_enable = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-profile-words") == 0) {
+            profile_enable = 1;
+            profile_words = 1;
+            argv += 1;
+        } else if (strcmp(*argv, "-sample") == 0 && argv[1]) {
+            sample_file = argv[1];
+            argv += 2;
+        } else if (strcmp(*argv, "-sample-hz") == 0 && argv[1]) {
+            sample_hz = atoi(argv[1]);
+            argv += 2;
+        } else if (strcmp(*argv, "-profile-top") == 0 && argv[1]) {
+            profile_top = atoi(argv[1]);
+            argv += 2;
         } else if (strcmp(*argv, "-b") == 0) {
             backtrace = 1;
             argv += 1;
@@ -150,42 +342,59 @@ int main(int argc, char *argv[])
     } while (save_argv != argv);
 
     canonicalise_path(forth_path);
+    io_init(output);
+
+    if (checkpoint_interval) {
+        undo_disable = 1;   // Checkpoints take the place of the undo log
+    }
+    if (batch_list && batch_reset && checkpoint_interval) {
+        error("-batch-reset can't be used with -checkpoint");
+    }
+
+    if (profile_enable && (!quiet || interactive || backtrace || checkpoint_interval || icache_disable)) {
+        error("-profile can't be used with -v, -i, -b, -checkpoint or -no-icache");
+    }
+
+    if (sample_file && (interactive || checkpoint_interval)) {
+        error("-sample can't be used with -i or -checkpoint");
+    }
 
-    memory_more(GB(2), MB(20));
+    forth_fuse = !no_fuse && !profile_enable && quiet && !interactive && !backtrace && undo_disable && !checkpoint_interval;
+    super_enable = !no_super && !profile_enable && quiet && !interactive && !backtrace && undo_disable && !checkpoint_interval;
 
-    file_t *forth_image = forth_init(filename, GB(2), MB(16));
-    reg pc = forth_entry(forth_image);
+    if (reserve) mem_reserve();
 
-    arm_set_reg(PC, pc);
-    arm_set_reg(R0, GB(2));
+    file_t *forth_image = NULL;
+    if (restore) {
+        snapshot_restore(restore);
+        dump = 0;   // There's no image to dump
+    } else if (boot_cache && !dump && snapshot_boot_restore(boot_cache, filename)) {
+        // Booted already
+    } else {
+        memory_more(GB(2), MB(20));
+
+        forth_image = forth_init(filename, GB(2), MB(16));
+        reg pc = forth_entry(forth_image);
+
+        arm_set_reg(PC, pc);
+        arm_set_reg(R0, GB(2));
+    }
 
     if (!dump) {
         if (!quiet) arm_dump_registers();
+        if (checkpoint_interval) checkpoint_init();
+        if (sample_file) sample_init();
         sim_done = 0;
         do {
-            if (!quiet) {
-                char buff[256];
-                int sz = sizeof(buff);
-                reg pc = arm_get_reg(PC);
-                if (mem_addr_is_valid(pc)) {
-                    reg instr = mem_load(pc, 0);
-                    disassemble(pc, instr, buff, sz);
-                    printf("%8.8x: %8.8x  %s\n", pc, instr, buff);
-                }
-            }
-            if (interactive) {
-                char command[256]; // Ignored today.  Will parse later.
-                printf("SIM> ");
-                fgets(command, sizeof(command), stdin);
-            }
-            if (!execute_one()) break;
-            if (backtrace) forth_backtrace();
-            if (!quiet) arm_dump_registers();
-        } while (!sim_done);
-        printf("Simulator terminated with sim_done == TRUE\n");
+            ok = sim_run();
+            printf("Simulator terminated with sim_done == TRUE\n");
+        } while (batch_next(ok));     // -batch-reset runs the next job here
+        if (fusion_report) super_report();
+        if (profile_enable) profile_report();
+        if (sample_file) sample_report();
     } else {
         mem_dump(forth_image->base + 0x38, (forth_image->size - 0x38)/4);
     }
 
-    return 0;
+    return batch_failed;
 }
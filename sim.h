@@ -30,7 +30,14 @@ typedef uint32_t reg;
 typedef int32_t sreg;
 typedef uint8_t  byte;
 
-extern int sim_done;
+/*
+ * sim_done is set when the program exits.  The sampling profiler's timer
+ * sets SIM_SAMPLE in it to stop the engine for a sample (see sample.c).
+ */
+
+extern volatile int sim_done;
+
+#define SIM_SAMPLE	2
 
 #define FALSE		(0)
 #define TRUE		(!FALSE)
@@ -71,6 +78,8 @@ extern reg docons_addr;
 extern reg dodoes_addr;
 
 extern int undo_disable;
+extern size_t undo_budget;
+extern int warn_disable;
 
 void brkpoint(void);
 void debug_if(int flag);
@@ -78,7 +87,20 @@ void warn(const char *fmt, ...);
 void error(const char *fmt, ...);
 void unpredictable(const char *fmt, ...);
 
+/*
+ * Guest memory is managed in pages of MEM_PAGE_SIZE bytes.
+ */
+#define MEM_PAGE_SHIFT		12
+#define MEM_PAGE_SIZE		(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK		(MEM_PAGE_SIZE - 1)
+#define MEM_NUM_PAGES		(1 << (32 - MEM_PAGE_SHIFT))
+#define MEM_PAGE(addr)		((addr) >> MEM_PAGE_SHIFT)
+
+extern int mem_track_writes;
+
+void mem_reserve(void);
 void memory_more(reg base, reg size);
+byte *mem_region(int i, reg *base, reg *size);
 reg mem_ram_base(void);
 reg mem_ram_size(void);
 void mem_set_image_size(int image_size);
@@ -93,9 +115,11 @@ reg mem_load(reg arm_addr, reg arm_offset);
     void mem_storeb(reg arm_addr, reg arm_offset, byte val);
 byte mem_loadb(reg arm_addr, reg arm_offset);
 void mem_dump(reg arm_addr, reg arm_numwords);
+void mem_will_write(reg arm_addr, reg size);
+void mem_clear_written(void);
+void mem_copy_page(reg page, byte *data, int restore);
 
 typedef struct file_s {
-    FILE *fp;
     char *name;
     byte *image;
     size_t image_size;
@@ -107,28 +131,96 @@ file_t *file_load(char *fname);
 void file_free(file_t *file);
 void file_put_in_memory(file_t *file, reg base);
 
+#define HASH_INIT	0xcbf29ce484222325ULL
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len);
+uint64_t file_hash(file_t *file);
+
+void reloc_apply(reg *dst, const reg *src, const reg *bits, reg ncells, reg base);
+
+extern char *image_cache;
 file_t *forth_init(char *filename, reg base, reg size);
 reg forth_entry(file_t *file);
 
 char *forth_lookup_word_name(reg cfa);
+reg forth_word_at(reg addr, reg limit);
+void forth_index_init(reg base);
+void forth_index_reset(void);
+reg forth_find_word(const char *name);
 reg forth_is_header(reg arm_addr);
 reg forth_is_word(reg addr);
 reg forth_is_string(reg addr);
 void forth_backtrace(void);
 void forth_show_stack(void);
-
+void forth_stacks(reg *sp, reg *rp);
+void forth_set_stacks(reg sp, reg rp);
+void forth_debugger(char *line);
+int forth_breakpoint(reg pc);
+extern int sim_continue;
+
+void io_init(char *output);
+void io_set_output(FILE *fp);
+void io_flush(void);
+void io_replay(const char *buf, size_t len);
 void io_write(reg str, reg len);
 reg io_readline(reg buffer, reg len);
 reg io_readfile(reg filename, reg len);
+reg io_getfiles(void);
+int input_queue_file(char *name);
+void input_queue_buffer(const char *buf, size_t len, int copy);
+void input_end(void);
+void input_discard(void);
+long input_line(char *s, reg len);
+void io_set_getfiles(reg addr);
+
+extern int baseline_active;
+void baseline_take(void);
+void baseline_page_written(reg page);
+void baseline_reset(void);
+
+extern char *batch_list;
+extern int batch_jobs;
+extern int batch_reset;
+extern int batch_failed;
+void batch_start(void);
+int batch_next(int ok);
+
+extern int snapshot_booting;
+int snapshot_save(char *filename);
+void snapshot_restore(char *filename);
+int snapshot_boot_restore(char *dir, char *image);
+void snapshot_boot_file(char *name, file_t *f);
+void snapshot_boot_output(char *s, reg len);
+void snapshot_boot_save(void);
+
+extern char *sample_file;
+extern int sample_hz;
+void sample_init(void);
+void sample_fork(void);
+void sample_reset(void);
+void sample_start(void);
+int sample_stop(void);
+void sample_report(void);
 
 void undo_record_reg(int reg_num);
 void undo_record_flags(void);
 void undo_record_memory(reg address);
 void undo_record_byte(reg address);
+void undo_record_range(reg address, reg size);
 void undo_finish_instr(void);
 int undo(int num_steps);
 int redo(int num_steps);
 int undo_size(void);
+void undo_forget(void);
 int redo_size(void);
 
+extern uint64_t checkpoint_interval;
+extern uint64_t checkpoint_count;
+extern int checkpoint_replaying;
+void checkpoint_init(void);
+void checkpoint_step(void);
+void checkpoint_page_written(reg page);
+uint64_t checkpoint_goto(uint64_t target);
+void checkpoint_log_input(reg addr, reg len, reg result);
+int checkpoint_replay_input(void);
+
 void disassemble(reg addr, reg instr, char *buff, int sz);
@@ -0,0 +1,490 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * snapshot.c
+ *
+ * Saving the whole machine to a file ("snapshot save <file>" at the
+ * interactive prompt) and starting from one (-restore <file>).
+ *
+ * A snapshot file is:
+ *
+ *	snapshot_header_t
+ *	a snapshot_region_t for each memory region
+ *	for each region, a byte per page: 1 if the page is in the file
+ *	padding to a page boundary
+ *	the pages, in region order, each MEM_PAGE_SIZE bytes
+ *
+ * Pages that are all zero aren't stored.  Since the stored pages are
+ * page aligned in the file, restoring maps them copy-on-write straight
+ * into the regions, so only pages the program touches are ever read.
+ *
+ * Numbers are in host byte order; the version check catches a snapshot
+ * from a host of the other order.  Bump SNAPSHOT_VERSION whenever the
+ * layout, or the state saved, changes.
+ */
+
+#include "sim.h"
+#include "arm.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC		"armsnap"
+#define SNAPSHOT_VERSION	1
+
+typedef struct snapshot_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t num_regions;
+    uint32_t data_offset;	// Of the first page
+    reg regs[NUM_REGS];
+    reg getfiles;		// See io_readfile()
+    reg sp0, rp0;		// See forth_init()
+} snapshot_header_t;
+
+typedef struct snapshot_region_s {
+    reg base, size;
+} snapshot_region_t;
+
+#define PAGES(size)		(((size) + MEM_PAGE_MASK) >> MEM_PAGE_SHIFT)
+
+static int snapshot_is_zero(byte *p, reg len)
+{
+    for (reg i = 0; i < len; i++) {
+        if (p[i]) return 0;
+    }
+
+    return 1;
+}
+
+int snapshot_save(char *filename)
+{
+    snapshot_header_t h;
+    snapshot_region_t *regions = NULL;
+    byte **maps = NULL;
+    byte *host;
+    reg base, size;
+    int n, ok = 0;
+
+    bzero(&h, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.page_size = MEM_PAGE_SIZE;
+    for (int i = 0; i < NUM_REGS; i++) {
+        h.regs[i] = arm_get_reg(i);
+    }
+    h.getfiles = io_getfiles();
+    forth_stacks(&h.sp0, &h.rp0);
+
+    size_t offset = sizeof(h);
+    for (n = 0; (host = mem_region(n, &base, &size)); n++) {
+        regions = realloc(regions, (n + 1) * sizeof(snapshot_region_t));
+        maps = realloc(maps, (n + 1) * sizeof(byte *));
+        ASSERT(regions && maps);
+
+        regions[n].base = base;
+        regions[n].size = size;
+        maps[n] = malloc(PAGES(size));
+        ASSERT(maps[n]);
+        for (reg p = 0; p < PAGES(size); p++) {
+            reg off = p << MEM_PAGE_SHIFT;
+            reg len = size - off < MEM_PAGE_SIZE ? size - off : MEM_PAGE_SIZE;
+            maps[n][p] = !snapshot_is_zero(host + off, len);
+        }
+        offset += sizeof(snapshot_region_t) + PAGES(size);
+    }
+    h.num_regions = n;
+    h.data_offset = (offset + MEM_PAGE_MASK) & ~MEM_PAGE_MASK;
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        warn("Couldn't create snapshot %s", filename);
+        goto out;
+    }
+
+    static byte zero[MEM_PAGE_SIZE];
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(regions, sizeof(snapshot_region_t), n, fp);
+    for (int i = 0; i < n; i++) {
+        fwrite(maps[i], 1, PAGES(regions[i].size), fp);
+    }
+    fwrite(zero, 1, h.data_offset - offset, fp);
+
+    for (int i = 0; i < n; i++) {
+        host = mem_region(i, &base, &size);
+        for (reg p = 0; p < PAGES(size); p++) {
+            if (!maps[i][p]) continue;
+
+            reg off = p << MEM_PAGE_SHIFT;
+            reg len = size - off < MEM_PAGE_SIZE ? size - off : MEM_PAGE_SIZE;
+            fwrite(host + off, 1, len, fp);
+            fwrite(zero, 1, MEM_PAGE_SIZE - len, fp);
+        }
+    }
+
+    ok = !ferror(fp);
+    if (fclose(fp) || !ok) {
+        warn("Couldn't write snapshot %s", filename);
+        ok = 0;
+    }
+
+out:
+    for (int i = 0; i < n; i++) {
+        free(maps[i]);
+    }
+    free(maps);
+    free(regions);
+
+    return ok;
+}
+
+/*
+ * snapshot_load_pages()
+ *
+ * Put npages pages from the file at offset into host memory: mapped, when
+ * the host's pages are the simulator's and host is on a page boundary,
+ * otherwise read.  len is how much of the last page belongs to the
+ * region.
+ */
+
+static void snapshot_load_pages(int fd, off_t offset, byte *host, reg npages, reg len)
+{
+    static long host_page;
+
+    if (!host_page) host_page = sysconf(_SC_PAGESIZE);
+
+    if (host_page == MEM_PAGE_SIZE && !((uintptr_t) host & MEM_PAGE_MASK) && len == MEM_PAGE_SIZE &&
+        mmap(host, (size_t) npages << MEM_PAGE_SHIFT, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED) {
+        return;
+    }
+
+    size_t size = ((size_t) (npages - 1) << MEM_PAGE_SHIFT) + len;
+    if (pread(fd, host, size, offset) != size) {
+        error("Snapshot is too short");
+    }
+}
+
+void snapshot_restore(char *filename)
+{
+    snapshot_header_t h;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        error("Couldn't open snapshot %s", filename);
+    }
+
+    if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+        memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+        error("%s isn't a snapshot", filename);
+    }
+    if (h.version != SNAPSHOT_VERSION || h.page_size != MEM_PAGE_SIZE) {
+        error("Snapshot %s is version %d; this simulator reads version %d",
+              filename, h.version, SNAPSHOT_VERSION);
+    }
+
+    struct stat st;
+    uint64_t table_size = sizeof(h) + (uint64_t) h.num_regions * sizeof(snapshot_region_t);
+
+    if (fstat(fd, &st) || table_size > h.data_offset || h.data_offset > st.st_size) {
+        error("Snapshot %s is damaged", filename);
+    }
+
+    byte *table = malloc(h.data_offset);
+    ASSERT(table);
+    if (pread(fd, table, h.data_offset, 0) != h.data_offset) {
+        error("Snapshot %s is too short", filename);
+    }
+
+    snapshot_region_t *regions = (snapshot_region_t *) (table + sizeof(h));
+    byte *map = (byte *) &regions[h.num_regions];
+    off_t offset = h.data_offset;
+
+    /*
+     * The maps must fit in the table, and the pages they say are stored
+     * in the file.
+     */
+    uint64_t data_size = 0;
+    for (int i = 0; i < h.num_regions; i++) {
+        uint64_t base = regions[i].base, size = regions[i].size;
+        uint64_t npages = (size + MEM_PAGE_MASK) >> MEM_PAGE_SHIFT;
+
+        if (base + size > (1ULL << 32) || table_size + npages > h.data_offset) {
+            error("Snapshot %s is damaged", filename);
+        }
+        for (uint64_t p = 0; p < npages; p++) {
+            if (table[table_size + p]) {
+                data_size += p == npages - 1 && (size & MEM_PAGE_MASK) ? size & MEM_PAGE_MASK : MEM_PAGE_SIZE;
+            }
+        }
+        table_size += npages;
+    }
+    if (h.data_offset + data_size > st.st_size) {
+        error("Snapshot %s is too short", filename);
+    }
+
+    for (int i = 0; i < h.num_regions; i++) {
+        reg base = regions[i].base, size = regions[i].size;
+        reg npages = PAGES(size);
+
+        memory_more(base, size);
+        byte *host = mem_region(i, &base, &size);
+
+        /*
+         * Runs of stored pages are next to each other in the file too.
+         */
+        for (reg p = 0; p < npages; ) {
+            reg q;
+
+            if (!map[p]) {
+                p++;
+                continue;
+            }
+            for (q = p; q < npages && map[q]; q++) {
+            }
+
+            reg len = MEM_PAGE_SIZE;
+            if (q == npages && (size & MEM_PAGE_MASK)) {
+                if (q - p > 1) {
+                    snapshot_load_pages(fd, offset, host + (p << MEM_PAGE_SHIFT), q - p - 1, len);
+                    offset += (off_t) (q - p - 1) << MEM_PAGE_SHIFT;
+                    p = q - 1;
+                }
+                len = size & MEM_PAGE_MASK;
+            }
+            snapshot_load_pages(fd, offset, host + (p << MEM_PAGE_SHIFT), q - p, len);
+            offset += (off_t) (q - p) << MEM_PAGE_SHIFT;
+            p = q;
+        }
+        map += npages;
+    }
+
+    for (int i = 0; i < NUM_REGS; i++) {
+        arm_set_reg(i, h.regs[i]);
+    }
+    io_set_getfiles(h.getfiles);
+    forth_set_stacks(h.sp0, h.rp0);
+
+    free(table);
+    close(fd);
+}
+
+/*
+ * Boot snapshots (-boot-cache dir)
+ *
+ * Before it first asks for a line, an image relocates itself and runs its
+ * startup, which may getfile a stack of source files.  With -boot-cache,
+ * a run that boots saves the machine at the first readline callback and
+ * later runs start there instead.
+ *
+ * For an image whose contents hash to I, the cache directory holds:
+ *
+ *	I.boot		the files the boot loaded, a line "hash name" each
+ *	K.snap		the machine at the first readline
+ *	K.out		what the boot printed
+ *
+ * K hashes I, SNAPSHOT_VERSION and each file the boot loaded.  A later
+ * run hashes the files listed in I.boot as they are now, so a change to
+ * the image or to any of its files gives a different K and the image
+ * boots again.  A file that couldn't be loaded hashes to 0.
+ */
+
+int snapshot_booting;
+
+static char *snapshot_boot_dir;
+static uint64_t snapshot_boot_image;	// I
+static uint64_t snapshot_boot_key;	// K, so far
+
+static FILE *snapshot_boot_files, *snapshot_boot_out;
+static char *snapshot_boot_files_buf, *snapshot_boot_out_buf;
+static size_t snapshot_boot_files_len, snapshot_boot_out_len;
+
+static uint64_t snapshot_file_hash(file_t *f)
+{
+    return f ? file_hash(f) : 0;
+}
+
+static uint64_t snapshot_key_add(uint64_t key, char *name, uint64_t hash)
+{
+    key = hash_bytes(key, &hash, sizeof(hash));
+    return hash_bytes(key, name, strlen(name) + 1);
+}
+
+static char *snapshot_boot_path(uint64_t hash, char *ext)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/%016llx.%s", snapshot_boot_dir, (unsigned long long) hash, ext) < 0) {
+        error("Out of memory");
+    }
+
+    return path;
+}
+
+/*
+ * snapshot_boot_restore()
+ *
+ * Start from the cached boot of image, if there is one.  Returns 0 if the
+ * image has to boot, in which case the boot is recorded for the cache.
+ */
+
+int snapshot_boot_restore(char *dir, char *image)
+{
+    file_t *f = file_load(image);
+
+    if (!f) return 0;   // forth_init() will complain
+
+    snapshot_boot_dir = dir;
+    snapshot_boot_image = snapshot_file_hash(f);
+    snapshot_boot_key = hash_bytes(HASH_INIT, &snapshot_boot_image, sizeof(uint64_t));
+    snapshot_boot_key = hash_bytes(snapshot_boot_key, &(uint32_t) {SNAPSHOT_VERSION}, sizeof(uint32_t));
+    file_free(f);
+
+    uint64_t key = snapshot_boot_key;
+    char *path = snapshot_boot_path(snapshot_boot_image, "boot");
+    FILE *fp = fopen(path, "r");
+    int found = fp != NULL;
+    free(path);
+
+    if (fp) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+
+        while (found && (len = getline(&line, &cap, fp)) > 0) {
+            unsigned long long want;
+            int name;
+
+            if (line[len - 1] == '\n') line[len - 1] = '\0';
+            if (sscanf(line, "%llx %n", &want, &name) != 1) {
+                found = 0;
+                break;
+            }
+
+            f = file_load(line + name);
+            uint64_t hash = snapshot_file_hash(f);
+            if (f) file_free(f);
+
+            found = hash == want;
+            key = snapshot_key_add(key, line + name, hash);
+        }
+        free(line);
+        fclose(fp);
+    }
+
+    char *snap = snapshot_boot_path(key, "snap");
+    found = found && access(snap, R_OK) == 0;
+    if (found) {
+        snapshot_restore(snap);
+
+        char *out = snapshot_boot_path(key, "out");
+        if ((fp = fopen(out, "r"))) {
+            char buff[4096];
+            size_t n;
+
+            while ((n = fread(buff, 1, sizeof(buff), fp)) > 0) {
+                io_replay(buff, n);
+            }
+            fclose(fp);
+        }
+        free(out);
+    } else {
+        snapshot_boot_files = open_memstream(&snapshot_boot_files_buf, &snapshot_boot_files_len);
+        snapshot_boot_out = open_memstream(&snapshot_boot_out_buf, &snapshot_boot_out_len);
+        ASSERT(snapshot_boot_files && snapshot_boot_out);
+        snapshot_booting = 1;
+    }
+    free(snap);
+
+    return found;
+}
+
+/*
+ * While booting, io_readfile() and io_write() tell us what the boot read
+ * and printed.
+ */
+
+void snapshot_boot_file(char *name, file_t *f)
+{
+    uint64_t hash = snapshot_file_hash(f);
+
+    fprintf(snapshot_boot_files, "%016llx %s\n", (unsigned long long) hash, name);
+    snapshot_boot_key = snapshot_key_add(snapshot_boot_key, name, hash);
+}
+
+void snapshot_boot_output(char *s, reg len)
+{
+    fwrite(s, 1, len, snapshot_boot_out);
+}
+
+/*
+ * Files in the cache are written under a temporary name and renamed, so
+ * runs sharing the cache never see half of one.
+ */
+
+static int snapshot_boot_write(char *path, char *data, size_t len)
+{
+    char *tmp;
+    int ok;
+
+    if (asprintf(&tmp, "%s.%d", path, (int) getpid()) < 0) {
+        error("Out of memory");
+    }
+
+    if (data) {
+        FILE *fp = fopen(tmp, "w");
+        ok = fp && fwrite(data, 1, len, fp) == len;
+        if (fp && fclose(fp)) ok = 0;
+    } else {
+        ok = snapshot_save(tmp);
+    }
+
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        warn("Couldn't write %s", path);
+        unlink(tmp);
+    }
+    free(tmp);
+
+    return ok;
+}
+
+/*
+ * snapshot_boot_save()
+ *
+ * Called at the first readline callback, before it runs, so a run
+ * started from the snapshot makes the call itself.
+ */
+
+void snapshot_boot_save(void)
+{
+    snapshot_booting = 0;
+    fclose(snapshot_boot_files);
+    fclose(snapshot_boot_out);
+
+    char *out = snapshot_boot_path(snapshot_boot_key, "out");
+    char *snap = snapshot_boot_path(snapshot_boot_key, "snap");
+    char *boot = snapshot_boot_path(snapshot_boot_image, "boot");
+
+    (void) mkdir(snapshot_boot_dir, 0777);
+
+    /*
+     * I.boot goes last: until it's there, nothing looks for the others.
+     */
+    (void) (snapshot_boot_write(out, snapshot_boot_out_buf, snapshot_boot_out_len) &&
+            snapshot_boot_write(snap, NULL, 0) &&
+            snapshot_boot_write(boot, snapshot_boot_files_buf, snapshot_boot_files_len));
+
+    free(out);
+    free(snap);
+    free(boot);
+    free(snapshot_boot_files_buf);
+    free(snapshot_boot_out_buf);
+}
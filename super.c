@@ -0,0 +1,190 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * super.c
+ *
+ * Superinstructions for the threaded engine.
+ *
+ * threaded_run() counts how often each icache entry runs.  When an entry
+ * gets hot, super_form() looks at the straight line code starting there
+ * and, if the entry and at least one following instruction can run
+ * back to back, makes the entry run a group of up to SUPER_MAX
+ * instructions with one dispatch.  A group ends at the first
+ * instruction that writes the PC (a branch may be the last member), at
+ * fused muForth machinery, and at the end of the icache page.
+ *
+ * The group keeps a copy of each member's icache entry and runs the
+ * members' own handlers in order, stepping the PC and checking each
+ * member's condition exactly as the dispatch loop would.  The
+ * architectural effects are those of the instructions run one at a time.
+ *
+ * Groups use the icache's span/covered marks, so a store into any member
+ * drops the group.  If a member stores into a later member, the group
+ * stops and the rest of it runs one instruction at a time.
+ *
+ * Which groups form is decided by the profile of the program being run,
+ * so the set adapts to the image.  With -fusion-report, super_report()
+ * lists the groups that ran, merged by instruction sequence, so the
+ * common idioms of an image can be seen.
+ */
+
+#include "sim.h"
+#include "arm.h"
+
+#define SUPER_MAX	3
+
+typedef struct super_group_s {
+    reg pc;
+    int len;
+    uint64_t runs;
+    icache_entry_t member[SUPER_MAX];
+} super_group_t;
+
+int super_enable;
+
+static super_group_t **super_groups;
+static int num_super_groups;
+
+static int super_run(icache_entry_t *e)
+{
+    super_group_t *g = e->group;
+    reg pc = g->pc;
+
+    g->runs++;
+
+    if (!g->member[0].handler(&g->member[0])) return 0;
+
+    for (int i = 1; i < g->len; i++) {
+        icache_entry_t *m = &g->member[i];
+
+        if (!e->handler) {
+            return 1;   // Stored over; the PC already points at m
+        }
+
+        pc += 4;
+        r[PC] = pc + 4;
+        if (m->cond != 0xE && !execute_check_conds(m->cond)) continue;
+        if (!m->handler(m)) return 0;
+    }
+
+    return 1;
+}
+
+void super_form(icache_entry_t *e, reg pc)
+{
+    icache_entry_t *member[SUPER_MAX];
+    int len = 1;
+
+    if (e->span > 1 || e->op == ARM_INSTR_B || icache_ends_block(e)) {
+        return;
+    }
+
+    member[0] = e;
+    while (len < SUPER_MAX) {
+        reg next = pc + len * 4;
+
+        if (!(next & ICACHE_PAGE_MASK) || !mem_range_is_valid(next, 4)) break;
+
+        icache_entry_t *m = icache_lookup(next);
+        if (!m || m->span > 1 || (m->op != ARM_INSTR_B && icache_ends_block(m))) break;
+
+        member[len++] = m;
+        if (m->op == ARM_INSTR_B) break;
+    }
+
+    if (len < 2) {
+        return;
+    }
+
+    super_group_t *g = calloc(1, sizeof(super_group_t));
+    ASSERT(g);
+    g->pc = pc;
+    g->len = len;
+    for (int i = 0; i < len; i++) {
+        g->member[i] = *member[i];
+    }
+
+    /*
+     * Groups are never freed: one that has been dropped still holds its
+     * counts for the report.
+     */
+    super_groups = realloc(super_groups, (num_super_groups + 1) * sizeof(*super_groups));
+    ASSERT(super_groups);
+    super_groups[num_super_groups++] = g;
+
+    for (int i = 1; i < len; i++) {
+        member[i]->covered = 1;
+    }
+    e->group = g;
+    e->span = len;
+    e->handler = super_run;
+}
+
+/*
+ * The report
+ */
+
+typedef struct super_idiom_s {
+    char text[256];
+    uint64_t runs;
+    int sites;
+} super_idiom_t;
+
+static int super_idiom_cmp(const void *a, const void *b)
+{
+    const super_idiom_t *x = a, *y = b;
+
+    if (x->runs != y->runs) return x->runs < y->runs ? 1 : -1;
+    return strcmp(x->text, y->text);
+}
+
+void super_report(void)
+{
+    super_idiom_t *idiom = calloc(num_super_groups + 1, sizeof(super_idiom_t));
+    int num_idioms = 0;
+    uint64_t total = 0;
+
+    ASSERT(idiom);
+
+    for (int i = 0; i < num_super_groups; i++) {
+        super_group_t *g = super_groups[i];
+        char text[256] = "";
+
+        if (!g->runs) continue;
+        total += g->runs;
+
+        for (int j = 0; j < g->len; j++) {
+            char buff[80];
+            disassemble(g->pc + j * 4, g->member[j].instr, buff, sizeof(buff));
+            if (j) strncat(text, " ; ", sizeof(text) - strlen(text) - 1);
+            strncat(text, buff, sizeof(text) - strlen(text) - 1);
+        }
+
+        int k;
+        for (k = 0; k < num_idioms; k++) {
+            if (strcmp(idiom[k].text, text) == 0) break;
+        }
+        if (k == num_idioms) {
+            strcpy(idiom[num_idioms++].text, text);
+        }
+        idiom[k].runs += g->runs;
+        idiom[k].sites++;
+    }
+
+    qsort(idiom, num_idioms, sizeof(super_idiom_t), super_idiom_cmp);
+
+    fprintf(stderr, "Superinstructions: %d formed, %d idioms, %llu runs\n",
+            num_super_groups, num_idioms, (unsigned long long) total);
+    fprintf(stderr, "%12s %6s  %s\n", "runs", "sites", "instructions");
+    for (int k = 0; k < num_idioms; k++) {
+        fprintf(stderr, "%12llu %6d  %s\n", (unsigned long long) idiom[k].runs,
+                idiom[k].sites, idiom[k].text);
+    }
+
+    free(idiom);
+}
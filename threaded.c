@@ -0,0 +1,347 @@
+/*
+ * This file is part of arm-sim: http://madscientistroom.org/arm-sim
+ *
+ * Copyright (c) 2010 Randy Thelen. All rights reserved, and all wrongs
+ * reversed. (See the file COPYRIGHT for details.)
+ */
+
+/*
+ * threaded.c
+ *
+ * The threaded execution engine.  Rather than running every
+ * data-processing instruction through execute.c's switch on the opcode
+ * (and then two more switches on the same opcode for the flags and the
+ * write back), each icache entry is given a handler that was compiled for
+ * exactly one opcode, operand form and S bit.  The same is done for the
+ * immediate forms of LDR/STR and for B/BL.  Anything else falls back to
+ * the interpreter's handlers.
+ *
+ * The handlers have exactly the same register, memory, flag and undo
+ * effects as the interpreter's, so the two engines can be compared
+ * instruction by instruction with -v.
+ */
+
+#include "sim.h"
+#include "arm.h"
+
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+
+#define R(n)	(r[(n)])
+
+#define UNDO_REG(n)		do { if (!undo_disable) undo_record_reg(n); } while (0)
+#define UNDO_MEM(a)		do { if (!undo_disable) undo_record_memory(a); } while (0)
+#define UNDO_BYTE(a)	do { if (!undo_disable) undo_record_byte(a); } while (0)
+
+/*
+ * Operand 2 forms
+ */
+
+enum {
+    FORM_IMM,           // #imm8, rotated
+    FORM_REG,           // rm
+    FORM_SHIFT,         // rm, <shift> #imm5
+    FORM_REG_SHIFT,     // rm, <shift> rs
+    NUM_FORMS
+};
+
+static ALWAYS_INLINE int threaded_dp(icache_entry_t *e, arm_instr_t op, int form, int s)
+{
+    reg rd = e->rd;
+    reg d, n, m, nc;
+
+    n = R(e->rn);
+    if (e->rn == PC) n += 4;
+
+    switch (form) {
+    case FORM_IMM:
+        m = e->imm;
+        nc = e->imm_carry;
+        break;
+    case FORM_REG:
+        m = R(e->rm);
+        if (e->rm == PC) m += 4;
+        nc = arm_flag_c();
+        break;
+    case FORM_SHIFT:
+        m = R(e->rm);
+        if (e->rm == PC) m += 4;
+        m = barrel_shifter(FALSE, m, e->shift_type, e->shift, &nc);
+        break;
+    default:
+        m = R(e->rm);
+        if (e->rm == PC) m += 8;
+        reg sh = R(e->rs);
+        if (e->rs == PC) sh += 8;
+        m = barrel_shifter(TRUE, m, e->shift_type, sh & 0xFF, &nc);
+        break;
+    }
+
+    switch (op) {
+    case ARM_INSTR_AND:         d = n & m    ; break;
+    case ARM_INSTR_EOR:         d = n ^ m    ; break;
+    case ARM_INSTR_SUB: m = ~m; d = n + m + 1; break;
+    case ARM_INSTR_RSB: n = ~n; d = m + n + 1; break;
+    case ARM_INSTR_ADD:         d = n + m    ; break;
+    case ARM_INSTR_ADC:         d = n + m + arm_flag_c(); break;
+    case ARM_INSTR_SBC: m = ~m; d = n + m + arm_flag_c(); break;
+    case ARM_INSTR_RSC: n = ~n; d = m + n + arm_flag_c(); break;
+    case ARM_INSTR_TST:         d = n & m    ; break;
+    case ARM_INSTR_TEQ:         d = n ^ m    ; break;
+    case ARM_INSTR_CMP: m = ~m; d = n + m + 1; break;
+    case ARM_INSTR_CMN:         d = n + m    ; break;
+    case ARM_INSTR_ORR:         d = n | m    ; break;
+    case ARM_INSTR_MOV:         d =     m    ; break;
+    case ARM_INSTR_BIC: m = ~m; d = n & m    ; break;
+    case ARM_INSTR_MVN: m = ~m; d =     m    ; break;
+    default:                    d =0xEEBADADD; break;
+    }
+
+    if (s && rd != PC) {
+        UNDO_REG(FLAGS);
+        switch (op) {
+        case ARM_INSTR_AND:
+        case ARM_INSTR_EOR:
+        case ARM_INSTR_TST:
+        case ARM_INSTR_TEQ:
+        case ARM_INSTR_ORR:
+        case ARM_INSTR_MOV:
+        case ARM_INSTR_BIC:
+        case ARM_INSTR_MVN:
+            arm_flags_logic(d, nc, arm_flag_v());
+            break;
+        default:
+            arm_flags_arith(n, m, d);
+            break;
+        }
+    }
+
+    switch (op) {
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_CMP:
+    case ARM_INSTR_CMN:
+        break;
+    default:
+        UNDO_REG(rd);
+        R(rd) = d;
+        break;
+    }
+
+    return 1;
+}
+
+#define DP_OPS(X)					\
+    X(and, ARM_INSTR_AND)			\
+    X(eor, ARM_INSTR_EOR)			\
+    X(sub, ARM_INSTR_SUB)			\
+    X(rsb, ARM_INSTR_RSB)			\
+    X(add, ARM_INSTR_ADD)			\
+    X(adc, ARM_INSTR_ADC)			\
+    X(sbc, ARM_INSTR_SBC)			\
+    X(rsc, ARM_INSTR_RSC)			\
+    X(tst, ARM_INSTR_TST)			\
+    X(teq, ARM_INSTR_TEQ)			\
+    X(cmp, ARM_INSTR_CMP)			\
+    X(cmn, ARM_INSTR_CMN)			\
+    X(orr, ARM_INSTR_ORR)			\
+    X(mov, ARM_INSTR_MOV)			\
+    X(bic, ARM_INSTR_BIC)			\
+    X(mvn, ARM_INSTR_MVN)
+
+#define DP_FORM(name, op, form, suffix)										\
+    static int dp_ ## name ## _ ## suffix(icache_entry_t *e)				\
+    { return threaded_dp(e, op, form, 0); }									\
+    static int dp_ ## name ## _ ## suffix ## _s(icache_entry_t *e)			\
+    { return threaded_dp(e, op, form, 1); }
+
+#define DP_DEFINE(name, op)							\
+    DP_FORM(name, op, FORM_IMM, imm)				\
+    DP_FORM(name, op, FORM_REG, reg)				\
+    DP_FORM(name, op, FORM_SHIFT, shift)			\
+    DP_FORM(name, op, FORM_REG_SHIFT, reg_shift)
+
+DP_OPS(DP_DEFINE)
+
+#define DP_ENTRY(name, suffix)	{ dp_ ## name ## _ ## suffix, dp_ ## name ## _ ## suffix ## _s }
+
+#define DP_TABLE(name, op)							\
+    [op - ARM_INSTR_AND] = {						\
+        [FORM_IMM]       = DP_ENTRY(name, imm),		\
+        [FORM_REG]       = DP_ENTRY(name, reg),		\
+        [FORM_SHIFT]     = DP_ENTRY(name, shift),	\
+        [FORM_REG_SHIFT] = DP_ENTRY(name, reg_shift),	\
+    },
+
+static const arm_handler_t dp_handlers[16][NUM_FORMS][2] = {
+    DP_OPS(DP_TABLE)
+};
+
+/*
+ * LDR/STR with an immediate offset
+ */
+
+static ALWAYS_INLINE int threaded_xfer(icache_entry_t *e, int load, int bytes, int pre, int wb)
+{
+    reg maddr = R(e->rn);
+
+    if (e->rn == PC) maddr += 4;
+    if (pre) maddr += e->imm;
+
+    if (load) {
+        UNDO_REG(e->rd);
+        if (!bytes) R(e->rd) = mem_load(maddr, 0);
+        else        R(e->rd) = mem_loadb(maddr, 0);
+    } else {
+        if (!bytes) {
+            UNDO_MEM(maddr);
+            mem_store(maddr, 0, R(e->rd));
+        } else {
+            UNDO_BYTE(maddr);
+            mem_storeb(maddr, 0, R(e->rd));
+        }
+    }
+
+    if (wb || !pre) {
+        if (!pre) maddr += e->imm;
+        UNDO_REG(e->rn);
+        R(e->rn) = maddr;
+    }
+
+    return 1;
+}
+
+#define XFER_DEFINE(name, load, bytes, pre, wb)								\
+    static int name(icache_entry_t *e)										\
+    { return threaded_xfer(e, load, bytes, pre, wb); }
+
+#define XFER_DEFINE_ALL(op, load)											\
+    XFER_DEFINE(op ## _post,       load, 0, 0, 0)							\
+    XFER_DEFINE(op ## _post_wb,    load, 0, 0, 1)							\
+    XFER_DEFINE(op ## _pre,        load, 0, 1, 0)							\
+    XFER_DEFINE(op ## _pre_wb,     load, 0, 1, 1)							\
+    XFER_DEFINE(op ## b_post,      load, 1, 0, 0)							\
+    XFER_DEFINE(op ## b_post_wb,   load, 1, 0, 1)							\
+    XFER_DEFINE(op ## b_pre,       load, 1, 1, 0)							\
+    XFER_DEFINE(op ## b_pre_wb,    load, 1, 1, 1)
+
+XFER_DEFINE_ALL(ldr, 1)
+XFER_DEFINE_ALL(str, 0)
+
+#define XFER_TABLE(op)														\
+    {																		\
+        { { op ## _post,  op ## _post_wb  }, { op ## _pre,  op ## _pre_wb  } }, \
+        { { op ## b_post, op ## b_post_wb }, { op ## b_pre, op ## b_pre_wb } }, \
+    }
+
+static const arm_handler_t xfer_handlers[2][2][2][2] = {
+    XFER_TABLE(str),
+    XFER_TABLE(ldr),
+};
+
+/*
+ * Branches
+ */
+
+static int threaded_b(icache_entry_t *e)
+{
+    R(PC) = e->imm;
+    return 1;
+}
+
+static int threaded_bl(icache_entry_t *e)
+{
+    UNDO_REG(LR);
+    R(LR) = R(PC);
+    R(PC) = e->imm;
+    return 1;
+}
+
+arm_handler_t threaded_handler(icache_entry_t *e)
+{
+    int form;
+
+    switch (e->op) {
+    case ARM_INSTR_B:
+        return e->link ? threaded_bl : threaded_b;
+
+    case ARM_INSTR_LDR:
+    case ARM_INSTR_STR:
+        if (!e->imm_form) return NULL;
+        return xfer_handlers[e->op == ARM_INSTR_LDR][e->byte_xfer][e->pre_post][e->write_back];
+
+    case ARM_INSTR_AND:
+    case ARM_INSTR_EOR:
+    case ARM_INSTR_SUB:
+    case ARM_INSTR_RSB:
+    case ARM_INSTR_ADD:
+    case ARM_INSTR_ADC:
+    case ARM_INSTR_SBC:
+    case ARM_INSTR_RSC:
+    case ARM_INSTR_TST:
+    case ARM_INSTR_TEQ:
+    case ARM_INSTR_CMP:
+    case ARM_INSTR_CMN:
+    case ARM_INSTR_ORR:
+    case ARM_INSTR_MOV:
+    case ARM_INSTR_BIC:
+    case ARM_INSTR_MVN:
+        if (e->imm_form) {
+            form = FORM_IMM;
+        } else if (e->reg_shift) {
+            form = FORM_REG_SHIFT;
+        } else if (e->shift_type == 0 && e->shift == 0) {
+            form = FORM_REG;
+        } else {
+            form = FORM_SHIFT;
+        }
+        return dp_handlers[e->op - ARM_INSTR_AND][form][e->setconds];
+
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * threaded_run()
+ *
+ * Run until the simulation is done or an instruction faults; returns 0
+ * on a fault.  The loop also stops for a sample (see sample.c).  This is
+ * only used when nothing needs to look at the machine between
+ * instructions (no tracing, backtraces or interactive prompt).  It is
+ * also where superinstructions are formed (see super.c).
+ */
+
+int threaded_run(void)
+{
+    while (!sim_done) {
+        reg pc = R(PC);
+
+        if (pc > 0 && pc < 6) {
+            execute_callbacks(pc);
+            continue;
+        }
+
+        icache_entry_t *e = icache_lookup(pc);
+        if (!e) {
+            return 0;
+        }
+
+        if (super_enable && ++e->heat == SUPER_THRESHOLD) {
+            super_form(e, pc);
+        }
+
+        UNDO_REG(PC);
+        R(PC) = pc + 4;
+
+        if (e->cond == 0xE || execute_check_conds(e->cond)) {
+            if (!e->handler(e)) {
+                undo_finish_instr();
+                return 0;
+            }
+        }
+
+        undo_finish_instr();
+    }
+
+    return 1;
+}
@@ -34,138 +34,629 @@
  * written out.
  */
 
+/*
+ * The journal
+ *
+ * Recording one log entry per register and memory write, plus one for the
+ * PC of every instruction, made undo several times slower than running
+ * without it.  So the log is a journal of blocks instead.  A block is a
+ * run of up to UNDO_BLOCK_MAX instructions; a callback is always a block
+ * by itself.  Branches don't end a block: undo only ever runs a block's
+ * instructions again from its start, and they take the same path every
+ * time.  A block records the address of its first instruction, how many
+ * instructions it holds, and the contents of each register and memory
+ * word the first time one of its instructions writes it.  Later writes to the same place in the same
+ * block are not recorded: restoring the first one is enough to get back
+ * to the start of the block.  The PC is never recorded; it is the block's
+ * start address.  An STM records the words it stores as one range.
+ *
+ * Undoing a whole block swaps its entries with the machine, as described
+ * above, and moves it to the redo list.  Undoing part of a block undoes
+ * the whole block and then runs the instructions that are to be kept
+ * again.  Callbacks are never run again, so input isn't read and output
+ * isn't written twice.
+ */
+
+/*
+ * The history
+ *
+ * Closed blocks are packed into chunks, so the history is limited by
+ * undo_budget instead of a fixed number of entries.  Every number in a
+ * packed block is a varint: seven bits a byte, low bits first, with the
+ * top bit set on every byte but the last.  A register entry is its
+ * register number in one byte.  A memory address is the zigzag encoded
+ * difference from the previous address in the block (the first one from
+ * the block's PC).  Contents are the zigzag encoded difference from what
+ * the machine holds when the block is packed.  A block is only unpacked
+ * when the machine is back in that state (the end of the block for undo,
+ * its start for redo), and most writes change a value only a little, so
+ * most contents pack into a byte or two.
+ *
+ * Each packed block is followed by its length as a varint with its bytes
+ * reversed, so the last block of a chunk can be found from the end.  The
+ * undo history and the redo list are both stacks of chunks.  When the
+ * history goes over budget, its oldest chunk is thrown away.
+ */
+
+#define UNDO_BLOCK_MAX		64
+#define UNDO_CHUNK_SIZE		KB(64)
+
+#define UNDO_REG		1
+#define UNDO_MEM		2
+#define UNDO_RANGE		3	// contents is a count of UNDO_DATA entries to follow
+#define UNDO_DATA		4
+
+#define PACK_MEM		0x20	// Packed tags; registers are their own number
+#define PACK_RANGE		0x21
+
 typedef struct {
-    int type;		// Negative if the next log entry is part of same instruction
-    union {
-        int reg_num;
-        reg address;
-    } u;
+    int type;
+    reg where;		// Register number or word address
     reg contents;
 } undo_log_entry_t;
 
+typedef struct {
+    reg pc;		// First instruction of the block
+    reg end_pc;		// The PC after the block; kept once it has been undone
+    int count;		// Number of instructions in the block
+    reg regs;		// Registers already recorded, one bit each
+    int num_logs, max_logs;
+    undo_log_entry_t *logs;
+} undo_block_t;
+
+typedef struct undo_chunk_s {
+    struct undo_chunk_s *older, *newer;
+    size_t used, size;
+    int count;		// Instructions packed into the chunk
+    byte data[];
+} undo_chunk_t;
+
+typedef struct {
+    undo_chunk_t *oldest, *newest;
+    size_t bytes;
+    int count;
+} undo_stack_t;
+
+int undo_disable;
+size_t undo_budget = MB(256);
+
 /*
- * Add logic to use head/tail pointers so that the system can back up N
- * instructions but can an arbitrary number of instructions.
+ * undo_open is the block being added to; it is closed (packed into the
+ * history) when the next block starts.  undo_work holds a block that has
+ * been unpacked.
+ *
+ * The top of redo_list is the next block to redo.  While a block is
+ * partly redone, redo_done of its instructions have been run again and
+ * are in the open block.
  */
 
-#define MAX_UNDO_LOGS		2000
-undo_log_entry_t undo_logs[MAX_UNDO_LOGS];
-int undo_started;
-int undo_count;
-int undo_disable;
-int undo_head, undo_tail;
+static undo_block_t undo_open, undo_work;
+static undo_stack_t undo_history, redo_list;
+static int undo_in_instr;
+static int undo_replaying;
+static int redo_done;
+
+static byte *undo_pack_buff;
+static size_t undo_pack_size;
+
+static byte *undo_put_varint(byte *p, reg v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+
+    return p;
+}
+
+static reg undo_get_varint(byte **pp)
+{
+    byte *p = *pp;
+    reg v = 0;
+
+    for (int shift = 0; ; shift += 7) {
+        v |= (reg) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) break;
+    }
+    *pp = p;
+
+    return v;
+}
+
+static reg undo_zigzag(reg v)
+{
+    return (v << 1) ^ (reg) ((sreg) v >> 31);
+}
+
+static reg undo_unzigzag(reg v)
+{
+    return (v >> 1) ^ -(v & 1);
+}
+
+static reg undo_current(int type, reg where)
+{
+    if (type == UNDO_REG) {
+        return where == FLAGS ? arm_get_reg(FLAGS) : r[where];
+    }
+
+    return mem_load(where, 0);
+}
+
+static void undo_drop_chunk(undo_stack_t *s, undo_chunk_t *c)
+{
+    if (c->older) c->older->newer = c->newer;
+    else          s->oldest = c->newer;
+    if (c->newer) c->newer->older = c->older;
+    else          s->newest = c->older;
+
+    s->bytes -= c->size;
+    s->count -= c->count;
+    free(c);
+}
+
+static void undo_pack(undo_stack_t *s, undo_block_t *b)
+{
+    size_t max = 20 + b->num_logs * 11;
+    reg prev = b->pc;
+
+    if (max > undo_pack_size) {
+        undo_pack_size = max * 2;
+        undo_pack_buff = realloc(undo_pack_buff, undo_pack_size);
+        ASSERT(undo_pack_buff);
+    }
+
+    byte *p = undo_pack_buff;
+    p = undo_put_varint(p, b->count);
+    p = undo_put_varint(p, b->pc);
+    p = undo_put_varint(p, undo_zigzag(b->end_pc - b->pc));
+
+    for (int i = 0; i < b->num_logs; i++) {
+        undo_log_entry_t *u = &b->logs[i];
+
+        switch (u->type) {
+        case UNDO_REG:
+            *p++ = u->where;
+            p = undo_put_varint(p, undo_zigzag(u->contents - undo_current(UNDO_REG, u->where)));
+            break;
+
+        case UNDO_MEM:
+            *p++ = PACK_MEM;
+            p = undo_put_varint(p, undo_zigzag(u->where - prev));
+            p = undo_put_varint(p, undo_zigzag(u->contents - mem_load(u->where, 0)));
+            prev = u->where;
+            break;
+
+        case UNDO_RANGE:
+            *p++ = PACK_RANGE;
+            p = undo_put_varint(p, undo_zigzag(u->where - prev));
+            p = undo_put_varint(p, u->contents);
+            for (reg j = 0; j < u->contents; j++) {
+                reg contents = b->logs[i + 1 + j].contents;
+                p = undo_put_varint(p, undo_zigzag(contents - mem_load(u->where + j * 4, 0)));
+            }
+            prev = u->where;
+            i += u->contents;
+            break;
+        }
+    }
+
+    byte len[5], *q = undo_put_varint(len, p - undo_pack_buff);
+    while (q > len) {
+        *p++ = *--q;
+    }
+
+    size_t size = p - undo_pack_buff;
+    undo_chunk_t *c = s->newest;
+    if (!c || c->used + size > c->size) {
+        size_t chunk_size = size > UNDO_CHUNK_SIZE ? size : UNDO_CHUNK_SIZE;
+
+        c = malloc(sizeof(undo_chunk_t) + chunk_size);
+        ASSERT(c);
+        c->older = s->newest;
+        c->newer = NULL;
+        c->used = 0;
+        c->size = chunk_size;
+        c->count = 0;
+        if (s->newest) s->newest->newer = c;
+        else           s->oldest = c;
+        s->newest = c;
+        s->bytes += chunk_size;
+    }
+
+    memcpy(c->data + c->used, undo_pack_buff, size);
+    c->used += size;
+    c->count += b->count;
+    s->count += b->count;
+
+    while (s == &undo_history && s->bytes > undo_budget && s->oldest != s->newest) {
+        undo_drop_chunk(s, s->oldest);
+    }
+}
 
 /*
- * undo_head points to the beginning of a complete undo log sequence.
- * undo_tail points to the next log entry to use.  When undo_tail points at
- * undo_head, i.e., the log is full, then when a new log entry is needed,
- * undo_head is pushed forward past the undo log sequence to point to the
- * first log entry in the next log sequence.
+ * undo_top()
  *
- * undo_count is the number of sequences contained between undo_head and
- * undo_tail.
+ * Find the last block packed onto a stack; returns a pointer to its
+ * first byte and sets *end to just past it.
  */
 
-#define UNDO_REG		1
-#define UNDO_MEM		2
+static byte *undo_top(undo_stack_t *s, byte **end)
+{
+    undo_chunk_t *c = s->newest;
+    byte *q = c->data + c->used;
+    reg len = 0;
+
+    for (int shift = 0; ; shift += 7) {
+        q--;
+        len |= (reg) (*q & 0x7f) << shift;
+        if (!(*q & 0x80)) break;
+    }
+    *end = q;
 
-#define NEXT(v)		(((v) + 1) % MAX_UNDO_LOGS)
-#define PREV(v)		(((v) + MAX_UNDO_LOGS - 1) % MAX_UNDO_LOGS)
+    return q - len;
+}
 
-static int undo_skip_forward(int seq_index)
+static int undo_top_count(undo_stack_t *s)
 {
-    while (undo_logs[seq_index].type < 0) {
-        seq_index = NEXT(seq_index);
+    byte *end, *p = undo_top(s, &end);
+
+    return undo_get_varint(&p);
+}
+
+static void undo_add(undo_block_t *b, int type, reg where, reg contents);
+
+/*
+ * undo_unpack()
+ *
+ * Pop the last block off a stack into b.  With b NULL, the block is just
+ * thrown away.
+ */
+
+static void undo_unpack(undo_stack_t *s, undo_block_t *b)
+{
+    undo_chunk_t *c = s->newest;
+    byte *end, *p = undo_top(s, &end);
+    byte *start = p;
+    int count = undo_get_varint(&p);
+
+    if (b) {
+        b->count = count;
+        b->pc = undo_get_varint(&p);
+        b->end_pc = b->pc + undo_unzigzag(undo_get_varint(&p));
+        b->regs = 0;
+        b->num_logs = 0;
+
+        reg prev = b->pc;
+        while (p < end) {
+            byte tag = *p++;
+
+            if (tag < PACK_MEM) {
+                b->regs |= 1 << tag;
+                undo_add(b, UNDO_REG, tag, undo_current(UNDO_REG, tag) + undo_unzigzag(undo_get_varint(&p)));
+                continue;
+            }
+
+            reg where = prev + undo_unzigzag(undo_get_varint(&p));
+            prev = where;
+            if (tag == PACK_MEM) {
+                undo_add(b, UNDO_MEM, where, mem_load(where, 0) + undo_unzigzag(undo_get_varint(&p)));
+            } else {
+                reg words = undo_get_varint(&p);
+                undo_add(b, UNDO_RANGE, where, words);
+                for (reg j = 0; j < words; j++) {
+                    undo_add(b, UNDO_DATA, 0, mem_load(where + j * 4, 0) + undo_unzigzag(undo_get_varint(&p)));
+                }
+            }
+        }
     }
 
-    return NEXT(seq_index);
+    c->used = start - c->data;
+    c->count -= count;
+    s->count -= count;
+    if (!c->used) {
+        undo_drop_chunk(s, c);
+    }
 }
 
-static undo_log_entry_t *undo_record_common(int type)
+static void redo_discard(void)
 {
-    undo_log_entry_t *u = &undo_logs[undo_tail];
-    u->type = type;
+    while (redo_list.newest) {
+        undo_drop_chunk(&redo_list, redo_list.newest);
+    }
+    redo_done = 0;
+}
 
-    undo_tail = NEXT(undo_tail);
+static void undo_close(void)
+{
+    if (undo_open.count) {
+        undo_open.end_pc = undo_open.pc;
+        undo_pack(&undo_history, &undo_open);
+        undo_open.count = 0;
+    }
+}
 
-    if (undo_tail == undo_head) {
-        undo_head = undo_skip_forward(undo_head);
-        undo_count --;
+static void undo_begin_instr(reg pc)
+{
+    if (!undo_replaying && redo_list.count) {
+        redo_discard();
+    }
+
+    if (pc < 6 || undo_open.pc < 6 || undo_open.count == UNDO_BLOCK_MAX) {
+        undo_close();
+    }
+
+    if (!undo_open.count) {
+        undo_open.pc = pc;
+        undo_open.regs = 0;
+        undo_open.num_logs = 0;
     }
 
-    return u;
+    undo_open.count++;
+    undo_in_instr = 1;
 }
 
-static void undo_start(void)
+static void undo_add(undo_block_t *b, int type, reg where, reg contents)
 {
-    undo_started = 1;
-    undo_count += 1;
+    if (b->num_logs == b->max_logs) {
+        b->max_logs = b->max_logs ? b->max_logs * 2 : 16;
+        b->logs = realloc(b->logs, b->max_logs * sizeof(undo_log_entry_t));
+        ASSERT(b->logs);
+    }
+
+    undo_log_entry_t *u = &b->logs[b->num_logs++];
+    u->type = type;
+    u->where = where;
+    u->contents = contents;
 }
 
-static void undo_another(void)
+static int undo_has_word(reg address)
 {
-    undo_log_entry_t *u = &undo_logs[PREV(undo_tail)];
-    u->type = -u->type;
+    undo_block_t *b = &undo_open;
+
+    for (int i = 0; i < b->num_logs; i++) {
+        undo_log_entry_t *u = &b->logs[i];
+
+        if (u->type == UNDO_MEM && u->where == address) return 1;
+        if (u->type == UNDO_RANGE) {
+            if (address - u->where < u->contents * 4) return 1;
+            i += u->contents;
+        }
+    }
+
+    return 0;
 }
 
 void undo_record_reg(int reg_num)
 {
-    undo_log_entry_t *u;
-
     if (undo_disable) return;
 
-    if (!undo_started) undo_start();
-    else undo_another();
+    if (reg_num == PC) {
+        if (!undo_in_instr) undo_begin_instr(r[PC]);
+        return;
+    }
 
-    u = undo_record_common(UNDO_REG);
-    u->u.reg_num = reg_num;
-    u->contents = arm_get_reg(reg_num);
+    if (!undo_open.count || (undo_open.regs & (1 << reg_num))) return;
+
+    undo_open.regs |= 1 << reg_num;
+    undo_add(&undo_open, UNDO_REG, reg_num, undo_current(UNDO_REG, reg_num));
 }
 
+/*
+ * Memory is recorded a word at a time.  Words outside of memory are not
+ * recorded: the store that follows can't change them.
+ */
 
 void undo_record_memory(reg address)
 {
-    undo_log_entry_t *u;
-
-    if (undo_disable) return;
+    if (undo_disable || !undo_open.count) return;
 
-    if (!undo_started) undo_start();
-    else undo_another();
+    address &= ~3;
+    if (!mem_range_is_valid(address, 4) || undo_has_word(address)) return;
 
-    u = undo_record_common(UNDO_MEM);
-    u->u.address = address;
-    u->contents = mem_load(address, 0);
+    undo_add(&undo_open, UNDO_MEM, address, mem_load(address, 0));
 }
 
 void undo_record_byte(reg address)
 {
-    undo_log_entry_t *u;
+    undo_record_memory(address);
+}
 
-    if (undo_disable) return;
+/*
+ * undo_record_range()
+ *
+ * Record size bytes at address, as one entry when none of it has been
+ * recorded in this block already.
+ */
+
+void undo_record_range(reg address, reg size)
+{
+    reg first = address & ~3;
+    reg words = (address + size - first + 3) / 4;
 
-    if (!undo_started) undo_start();
-    else undo_another();
+    if (undo_disable || !undo_open.count || !size) return;
 
-    u = undo_record_common(UNDO_MEM);
-    u->u.address = address;
-    u->contents = mem_loadb(address, 0);
+    int fresh = mem_range_is_valid(first, words * 4);
+    for (reg i = 0; fresh && i < words; i++) {
+        fresh = !undo_has_word(first + i * 4);
+    }
+
+    if (!fresh) {
+        for (reg i = 0; i < words; i++) {
+            undo_record_memory(first + i * 4);
+        }
+        return;
+    }
+
+    undo_add(&undo_open, UNDO_RANGE, first, words);
+    for (reg i = 0; i < words; i++) {
+        undo_add(&undo_open, UNDO_DATA, 0, mem_load(first + i * 4, 0));
+    }
 }
 
 void undo_finish_instr(void)
 {
-    undo_started = 0;
+    undo_in_instr = 0;
+}
+
+/*
+ * undo_swap()
+ *
+ * Exchange a block's entries with the machine.  Each place appears in a
+ * block only once, so the order doesn't matter.
+ */
+
+static void undo_swap(undo_block_t *b)
+{
+    for (int i = 0; i < b->num_logs; i++) {
+        undo_log_entry_t *u = &b->logs[i];
+        reg contents;
+
+        switch (u->type) {
+        case UNDO_REG:
+            contents = arm_get_reg(u->where);
+            arm_set_reg(u->where, u->contents);
+            u->contents = contents;
+            break;
+
+        case UNDO_MEM:
+            contents = mem_load(u->where, 0);
+            mem_store(u->where, 0, u->contents);
+            u->contents = contents;
+            break;
+
+        case UNDO_RANGE:
+            for (reg j = 0; j < u->contents; j++) {
+                undo_log_entry_t *d = &b->logs[i + 1 + j];
+                contents = mem_load(u->where + j * 4, 0);
+                mem_store(u->where + j * 4, 0, d->contents);
+                d->contents = contents;
+            }
+            i += u->contents;
+            break;
+        }
+    }
+}
+
+/*
+ * Run num_steps instructions again, into the open block.
+ */
+
+static void undo_rerun(int num_steps)
+{
+    undo_replaying = 1;
+    warn_disable++;
+    while (num_steps--) {
+        execute_one();
+    }
+    warn_disable--;
+    undo_replaying = 0;
 }
 
-void undo_clear(void)
+int undo(int num_steps)
 {
+    int done = 0;
+
+    while (done < num_steps) {
+        undo_block_t *b = &undo_open;
+
+        if (!b->count) {
+            if (!undo_history.newest) break;
+            b = &undo_work;
+            undo_unpack(&undo_history, b);
+        }
+
+        int left = num_steps - done;
+        int keep = b->count > left ? b->count - left : 0;
+
+        undo_swap(b);
+        done += b->count - keep;
+        undo_in_instr = 0;
+
+        if (redo_done) {
+            /*
+             * This is the open block, holding the part of the next redo
+             * block that has been run again.  That block already covers
+             * it.
+             */
+            arm_set_reg(PC, b->pc);
+            redo_done = 0;
+        } else {
+            b->end_pc = arm_get_reg(PC);
+            arm_set_reg(PC, b->pc);
+            undo_pack(&redo_list, b);
+        }
+        undo_open.count = 0;
+
+        if (keep) {
+            undo_rerun(keep);
+            redo_done = keep;
+        }
+    }
+
+    /*
+     * Words may have gone, or come back (see forth_index_reset()).
+     */
+    if (done) forth_index_reset();
+
+    return done;
+}
+
+int redo(int num_steps)
+{
+    int done = 0;
+
+    while (done < num_steps && redo_list.newest) {
+        int count = undo_top_count(&redo_list);
+        int left = num_steps - done;
+        int rest = count - redo_done;
+
+        if (!redo_done && rest <= left) {
+            undo_close();
+            undo_unpack(&redo_list, &undo_work);
+            undo_swap(&undo_work);
+            arm_set_reg(PC, undo_work.end_pc);
+            undo_pack(&undo_history, &undo_work);
+            undo_in_instr = 0;
+        } else {
+            if (rest > left) rest = left;
+            undo_rerun(rest);
+            redo_done += rest;
+            if (redo_done == count) {
+                undo_unpack(&redo_list, NULL);
+                redo_done = 0;
+            }
+        }
+
+        done += rest;
+    }
+
+    if (done) forth_index_reset();
+
+    return done;
 }
 
-int undo(int num_steps);
-int redo(int num_steps);
+/*
+ * Forget all history, for when the machine is put somewhere else
+ * entirely (see baseline_reset()).
+ */
+
+void undo_forget(void)
+{
+    redo_discard();
+    while (undo_history.newest) {
+        undo_drop_chunk(&undo_history, undo_history.newest);
+    }
+    undo_open.count = 0;
+    undo_in_instr = 0;
+}
 
 int undo_size(void)
 {
-    return undo_count;
+    return undo_history.count + undo_open.count;
 }
 
-int redo_size(void);
+int redo_size(void)
+{
+    return redo_list.count - redo_done;
+}
@@ -33,10 +33,18 @@ void error(const char *fmt, ...)
     exit(-1);
 }
 
+/*
+ * Warnings are turned off while undo runs instructions a second time.
+ */
+
+int warn_disable;
+
 void warn(const char *fmt, ...)
 {
     va_list ap;
 
+    if (warn_disable) return;
+
     printf("Warning: ");
     va_start(ap, fmt);
     vprintf(fmt, ap);